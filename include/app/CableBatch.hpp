@@ -0,0 +1,271 @@
+#pragma once
+#include <app/common.hpp>
+#include <app/CableWidget.hpp>
+#include <settings.hpp>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+
+namespace rack {
+namespace app {
+
+
+/** Tessellates cables on the CPU and draws them with a few batched NanoVG strokes per frame.
+
+Drawing each CableWidget individually costs three strokes (shadow, outline, solid) per cable, which dominates the frame time of patches with 1000+ cables.
+CableBatch caches the tessellated curve of each cable and only recomputes it when its endpoints or the tension change.
+Cables are then grouped into layers of equal opacity, and all cables of a layer sharing a color and thickness are submitted as subpaths of a single stroke.
+
+Usage in a cable container's draw():
+
+	batch.begin(args.vg);
+	for (widget::Widget* w : children) {
+		batch.addCable(dynamic_cast<CableWidget*>(w));
+	}
+	batch.draw(args.vg);
+
+Cables are drawn in layer order rather than child order, so overlapping cables of different layers may stack differently than with CableWidget::draw().
+Within a layer, all outlines are stroked before all solids, so where two cables of a layer cross, the upper cable has no dark outline separating it from the lower one.
+Plugs are not batched. Call CableWidget::drawPlugs() as usual.
+*/
+struct CableBatch {
+	struct Curve {
+		math::Vec outputPos;
+		math::Vec inputPos;
+		float tension = NAN;
+		/** Screen pixels per unit when tessellated */
+		float scale = NAN;
+		/** Tessellated points of the cable and its shadow. */
+		std::vector<math::Vec> points;
+		std::vector<math::Vec> shadowPoints;
+		/** Set by addCable(), cleared by begin(). Curves not touched during a frame are removed by draw(). */
+		bool used = false;
+	};
+
+	/** A set of cables drawn with the same stroke */
+	struct Stroke {
+		NVGcolor color;
+		float thickness;
+		std::vector<const Curve*> curves;
+	};
+
+	/** All cables drawn with the same global alpha.
+	Layers and strokes are kept across frames so their vectors keep their capacity, and are removed once unused for a frame.
+	*/
+	struct Layer {
+		float opacity;
+		/** Order of first use in the current frame, or -1 if unused */
+		int order = -1;
+		std::vector<Stroke> shadows;
+		std::vector<Stroke> outlines;
+		std::vector<Stroke> solids;
+	};
+
+	std::map<const CableWidget*, Curve> curves;
+	std::vector<Layer> layers;
+	/** Number of layers used in the current frame */
+	int layerCount = 0;
+	/** Used layers in order of first use. Kept to reuse its capacity. */
+	std::vector<const Layer*> sortedLayers;
+	/** Maximum distance between the tessellated and the exact curve in screen pixels, like NanoVG's tessellation tolerance. */
+	float tolerance = 0.25f;
+	/** Screen pixels per unit of the current frame */
+	float scale = 1.f;
+
+	/** Starts a frame. The current transform of `vg` must be the one the cables are drawn with, so curves are tessellated for the rack zoom. */
+	void begin(NVGcontext* vg) {
+		float xform[6];
+		nvgCurrentTransform(vg, xform);
+		scale = std::sqrt(std::fabs(xform[0] * xform[3] - xform[1] * xform[2]));
+		if (!(scale > 0.f))
+			scale = 1.f;
+
+		for (auto& pair : curves) {
+			pair.second.used = false;
+		}
+		for (Layer& layer : layers) {
+			layer.order = -1;
+			for (std::vector<Stroke>* strokes : {&layer.shadows, &layer.outlines, &layer.solids}) {
+				for (Stroke& stroke : *strokes) {
+					stroke.curves.clear();
+				}
+			}
+		}
+		layerCount = 0;
+	}
+
+	/** Adds a cable using the same opacity and thickness rules as CableWidget::draw(). */
+	void addCable(CableWidget* cw) {
+		if (!cw || !cw->visible)
+			return;
+		float opacity = settings::cableOpacity;
+		float thickness = 5;
+		if (cw->isComplete()) {
+			engine::Output* output = &cw->cable->outputModule->outputs[cw->cable->outputId];
+			// Increase thickness if output port is polyphonic
+			if (output->channels > 1)
+				thickness = 9;
+			// Draw opaque if mouse is hovering over a connected port
+			if (cw->outputPort->hovered || cw->inputPort->hovered)
+				opacity = 1.f;
+			// Draw translucent cable if not active
+			else if (output->channels == 0)
+				opacity *= 0.5f;
+		}
+		else {
+			// Draw opaque if the cable is incomplete
+			opacity = 1.f;
+		}
+		addCable(cw, cw->getOutputPos(), cw->getInputPos(), cw->color, thickness, opacity);
+	}
+
+	/** Adds a cable with explicit endpoints and style. `key` identifies the cached curve across frames. */
+	void addCable(const CableWidget* key, math::Vec outputPos, math::Vec inputPos, NVGcolor color, float thickness, float opacity) {
+		if (opacity <= 0.f)
+			return;
+		Curve& curve = curves[key];
+		float tension = settings::cableTension;
+		if (curve.points.empty() || !curve.outputPos.isEqual(outputPos) || !curve.inputPos.isEqual(inputPos) || curve.tension != tension || curve.scale != scale) {
+			tessellate(curve, outputPos, inputPos, tension);
+		}
+		curve.used = true;
+
+		Layer& layer = getLayer(opacity);
+		getStroke(layer.shadows, nvgRGBAf(0, 0, 0, 0.10), thickness).curves.push_back(&curve);
+		getStroke(layer.outlines, nvgLerpRGBA(color, nvgRGBf(0.0, 0.0, 0.0), 0.5), thickness).curves.push_back(&curve);
+		getStroke(layer.solids, color, thickness - 2).curves.push_back(&curve);
+	}
+
+	/** Draws all layers and removes cached curves of cables that were not added since begin(). */
+	void draw(NVGcontext* vg) {
+		sortedLayers.clear();
+		for (const Layer& layer : layers) {
+			if (layer.order >= 0)
+				sortedLayers.push_back(&layer);
+		}
+		std::sort(sortedLayers.begin(), sortedLayers.end(), [](const Layer* a, const Layer* b) {
+			return a->order < b->order;
+		});
+
+		for (const Layer* layerPtr : sortedLayers) {
+			const Layer& layer = *layerPtr;
+			nvgSave(vg);
+			// This power scaling looks more linear than actual linear scaling
+			nvgGlobalAlpha(vg, std::pow(layer.opacity, 1.5f));
+			nvgLineJoin(vg, NVG_ROUND);
+			for (const Stroke& stroke : layer.shadows) {
+				drawStroke(vg, stroke, true);
+			}
+			for (const Stroke& stroke : layer.outlines) {
+				drawStroke(vg, stroke, false);
+			}
+			for (const Stroke& stroke : layer.solids) {
+				drawStroke(vg, stroke, false);
+			}
+			nvgRestore(vg);
+		}
+
+		for (auto it = curves.begin(); it != curves.end();) {
+			if (!it->second.used)
+				it = curves.erase(it);
+			else
+				it++;
+		}
+
+		// Remove strokes and layers unused this frame
+		auto isStrokeUnused = [](const Stroke& stroke) {
+			return stroke.curves.empty();
+		};
+		for (Layer& layer : layers) {
+			for (std::vector<Stroke>* strokes : {&layer.shadows, &layer.outlines, &layer.solids}) {
+				strokes->erase(std::remove_if(strokes->begin(), strokes->end(), isStrokeUnused), strokes->end());
+			}
+		}
+		layers.erase(std::remove_if(layers.begin(), layers.end(), [](const Layer& layer) {
+			return layer.order < 0;
+		}), layers.end());
+	}
+
+	void tessellate(Curve& curve, math::Vec pos1, math::Vec pos2, float tension) {
+		curve.outputPos = pos1;
+		curve.inputPos = pos2;
+		curve.tension = tension;
+		curve.scale = scale;
+
+		float dist = pos1.minus(pos2).norm();
+		math::Vec slump;
+		slump.y = (1.f - tension) * (150.f + 1.f * dist);
+		math::Vec pos3 = pos1.plus(pos2).div(2).plus(slump);
+		math::Vec pos4 = pos3.plus(slump.mult(0.08f));
+
+		// Adjust pos1 and pos2 to not draw over the plug
+		pos1 = pos1.plus(pos3.minus(pos1).normalize().mult(9));
+		pos2 = pos2.plus(pos3.minus(pos2).normalize().mult(9));
+
+		int segments = std::max(getSegments(pos1, pos3, pos2), getSegments(pos1, pos4, pos2));
+		tessellateQuad(curve.points, pos1, pos3, pos2, segments);
+		tessellateQuad(curve.shadowPoints, pos1, pos4, pos2, segments);
+	}
+
+	/** Returns the number of segments for a quadratic curve to deviate at most `tolerance` screen pixels from the exact curve. */
+	int getSegments(math::Vec p0, math::Vec p1, math::Vec p2) {
+		// With n segments, the deviation is at most |p0 - 2 p1 + p2| / (4 n^2)
+		float curvature = p0.minus(p1.mult(2)).plus(p2).norm() * scale;
+		return std::max((int) std::ceil(std::sqrt(curvature / (4 * tolerance))), 4);
+	}
+
+	static void tessellateQuad(std::vector<math::Vec>& points, math::Vec p0, math::Vec p1, math::Vec p2, int segments) {
+		points.resize(segments + 1);
+		for (int i = 0; i <= segments; i++) {
+			float t = (float) i / segments;
+			float u = 1.f - t;
+			points[i] = p0.mult(u * u).plus(p1.mult(2.f * u * t)).plus(p2.mult(t * t));
+		}
+	}
+
+	Layer& getLayer(float opacity) {
+		for (Layer& layer : layers) {
+			if (layer.opacity == opacity) {
+				if (layer.order < 0)
+					layer.order = layerCount++;
+				return layer;
+			}
+		}
+		layers.push_back(Layer());
+		layers.back().opacity = opacity;
+		layers.back().order = layerCount++;
+		return layers.back();
+	}
+
+	static Stroke& getStroke(std::vector<Stroke>& strokes, NVGcolor color, float thickness) {
+		for (Stroke& stroke : strokes) {
+			if (stroke.thickness == thickness && std::memcmp(&stroke.color, &color, sizeof(color)) == 0)
+				return stroke;
+		}
+		strokes.push_back(Stroke());
+		strokes.back().color = color;
+		strokes.back().thickness = thickness;
+		return strokes.back();
+	}
+
+	static void drawStroke(NVGcontext* vg, const Stroke& stroke, bool shadow) {
+		if (stroke.curves.empty())
+			return;
+		nvgBeginPath(vg);
+		for (const Curve* curve : stroke.curves) {
+			const std::vector<math::Vec>& points = shadow ? curve->shadowPoints : curve->points;
+			nvgMoveTo(vg, points[0].x, points[0].y);
+			for (size_t i = 1; i < points.size(); i++) {
+				nvgLineTo(vg, points[i].x, points[i].y);
+			}
+		}
+		nvgStrokeColor(vg, stroke.color);
+		nvgStrokeWidth(vg, stroke.thickness);
+		nvgStroke(vg);
+	}
+};
+
+
+} // namespace app
+} // namespace rack
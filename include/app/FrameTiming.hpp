@@ -0,0 +1,124 @@
+#pragma once
+#include <app/common.hpp>
+#include <app.hpp>
+#include <window.hpp>
+#include <event.hpp>
+#include <algorithm>
+
+
+namespace rack {
+namespace app {
+
+
+/** Measures the UI frame rate from Window::frameTimeStart, which Window::run() sets at the start of each frame.
+Call step() from a widget's step(). Calls after the first in the same frame are ignored, so several widgets can share an instance.
+*/
+struct FrameStats {
+	/** Time between frame starts in seconds, with exponential smoothing */
+	float framePeriod = 0.f;
+	/** Longest time between frame starts since the last reset() */
+	float maxFramePeriod = 0.f;
+	int frameCount = 0;
+
+	int lastFrame = -1;
+	double lastFrameTimeStart = NAN;
+
+	void step(const Window* window) {
+		if (window->frame == lastFrame)
+			return;
+		lastFrame = window->frame;
+		double time = window->frameTimeStart;
+		if (std::isfinite(lastFrameTimeStart)) {
+			const float lambda = 0.1f;
+			float period = time - lastFrameTimeStart;
+			if (frameCount == 1)
+				framePeriod = period;
+			else
+				framePeriod += (period - framePeriod) * lambda;
+			maxFramePeriod = std::max(maxFramePeriod, period);
+		}
+		lastFrameTimeStart = time;
+		frameCount++;
+	}
+
+	void step() {
+		step(APP->window);
+	}
+
+	float getFrameRate() const {
+		return (framePeriod > 0.f) ? 1.f / framePeriod : 0.f;
+	}
+
+	void reset() {
+		framePeriod = 0.f;
+		maxFramePeriod = 0.f;
+		frameCount = 0;
+		lastFrameTimeStart = NAN;
+	}
+};
+
+
+/** Limits how often an expensive widget redraws, e.g. a scope or spectrum display, and redraws even less often while the user is idle.
+
+The UI frame loop is in Window::run(), and `settings::frameSwapInterval` is a saved user setting, so this throttles per widget instead of changing the frame rate.
+Most of the UI thread's time is spent drawing, so wrapping the content of expensive displays in a FramebufferWidget and redrawing it at a lower rate reduces the UI's CPU usage without touching settings.
+
+	struct ScopeDisplay : widget::FramebufferWidget {
+		app::RedrawThrottle throttle;
+		void step() override {
+			if (throttle.step())
+				dirty = true;
+			widget::FramebufferWidget::step();
+		}
+	};
+
+Moving the mouse, dragging, and holding keys count as activity.
+Call interact() for other activity, e.g. when the displayed signal changes.
+*/
+struct RedrawThrottle {
+	/** Redraws per second while the user is active, or 0 to redraw every frame */
+	float activeRate = 30.f;
+	/** Redraws per second while the user is idle */
+	float idleRate = 5.f;
+	/** Seconds without activity before the user is idle */
+	float idleDelay = 2.f;
+
+	double lastActivityTime = -INFINITY;
+	double lastRedrawTime = -INFINITY;
+	math::Vec lastMousePos;
+
+	void interact() {
+		lastActivityTime = APP->window->frameTimeStart;
+	}
+
+	bool isIdle(double time) const {
+		return time - lastActivityTime >= idleDelay;
+	}
+
+	/** Returns whether the widget should redraw this frame. */
+	bool step(const Window* window, const event::State* state) {
+		double time = window->frameTimeStart;
+		if (!window->mousePos.isEqual(lastMousePos) || state->draggedWidget || !state->heldKeys.empty()) {
+			lastMousePos = window->mousePos;
+			lastActivityTime = time;
+		}
+
+		float rate = isIdle(time) ? idleRate : activeRate;
+		if (rate > 0.f) {
+			// Allow a quarter of the interval early, so frame time jitter doesn't skip a whole frame
+			double interval = 1.0 / rate;
+			if (time - lastRedrawTime < interval * 0.75)
+				return false;
+		}
+		lastRedrawTime = time;
+		return true;
+	}
+
+	bool step() {
+		return step(APP->window, APP->event);
+	}
+};
+
+
+} // namespace app
+} // namespace rack
@@ -0,0 +1,139 @@
+#pragma once
+#include <app/common.hpp>
+#include <app/ModuleWidget.hpp>
+#include <app/RackWidget.hpp>
+#include <app/Scene.hpp>
+#include <engine/ModuleSnapshot.hpp>
+#include <engine/Engine.hpp>
+#include <app.hpp>
+#include <history.hpp>
+#include <window.hpp>
+#include <jansson.h>
+#include <cstring>
+
+
+namespace rack {
+namespace app {
+
+
+/** Undoes and redoes a change of module state with snapshots instead of JSON. */
+struct ModuleSnapshotChange : history::ModuleAction {
+	engine::ModuleSnapshot oldSnapshot;
+	engine::ModuleSnapshot newSnapshot;
+
+	ModuleSnapshotChange() {
+		name = "change module";
+	}
+
+	static void restore(int moduleId, const engine::ModuleSnapshot& snapshot) {
+		engine::Module* module = APP->engine->getModule(moduleId);
+		if (!module)
+			return;
+		snapshot.restore(module);
+		if (module->bypass != snapshot.bypass)
+			APP->engine->bypassModule(module, snapshot.bypass);
+	}
+
+	void undo() override {
+		restore(moduleId, oldSnapshot);
+	}
+	void redo() override {
+		restore(moduleId, newSnapshot);
+	}
+};
+
+
+/** Copies, pastes, and clones module state within the process without serializing it to a string.
+
+ModuleWidget::copyClipboard() and pasteClipboardAction() dump the module to a JSON string and parse it back, which takes a long time for modules with large data.
+This clipboard also keeps a ModuleSnapshot of the copied module, which is restored directly when pasting into the same model.
+Modules implementing engine::BinaryStateModule skip JSON entirely.
+
+If `exportJson` is set, copy() also writes JSON to the system clipboard so other Rack processes can paste it.
+The JSON is built from the snapshot, but dumping it to a string still takes time for modules with large data, and BinaryStateModules are serialized with dataToJson() for it, so exporting is off by default.
+If the system clipboard has changed since, paste() parses it like pasteClipboardAction().
+*/
+struct ModuleClipboard {
+	bool exportJson = false;
+
+	plugin::Model* model = NULL;
+	engine::ModuleSnapshot snapshot;
+	/** The text written to the system clipboard by copy() */
+	std::string exportedText;
+
+	void copy(ModuleWidget* mw) {
+		model = mw->model;
+		snapshot.capture(mw->module);
+		exportedText = "";
+		if (!exportJson)
+			return;
+		json_t* moduleJ = snapshot.toJson();
+		DEFER({
+			json_decref(moduleJ);
+		});
+		json_object_set_new(moduleJ, "version", json_string(model->plugin->version.c_str()));
+		// The snapshot has no JSON data for BinaryStateModules
+		if (snapshot.binary) {
+			json_t* dataJ = mw->module->dataToJson();
+			if (dataJ)
+				json_object_set_new(moduleJ, "data", dataJ);
+		}
+		char* moduleJson = json_dumps(moduleJ, JSON_INDENT(2) | JSON_REAL_PRECISION(9));
+		if (!moduleJson)
+			return;
+		DEFER({
+			std::free(moduleJson);
+		});
+		glfwSetClipboardString(APP->window->win, moduleJson);
+		exportedText = moduleJson;
+	}
+
+	/** Returns whether paste() can restore the snapshot instead of parsing the system clipboard. */
+	bool hasSnapshotFor(ModuleWidget* mw) {
+		if (!model || mw->model != model)
+			return false;
+		if (!exportJson)
+			return true;
+		// Compare with what we exported, in case another process has written to the clipboard since.
+		const char* text = glfwGetClipboardString(APP->window->win);
+		return text && exportedText == text;
+	}
+
+	void paste(ModuleWidget* mw) {
+		if (!hasSnapshotFor(mw)) {
+			mw->pasteClipboardAction();
+			return;
+		}
+		ModuleSnapshotChange* h = new ModuleSnapshotChange;
+		h->name = "paste module preset";
+		h->moduleId = mw->module->id;
+		h->oldSnapshot.capture(mw->module);
+		h->newSnapshot = snapshot;
+		ModuleSnapshotChange::restore(mw->module->id, snapshot);
+		APP->history->push(h);
+	}
+
+	/** Adds a copy of the module at the mouse position, like ModuleWidget::cloneAction(), but without building a JSON tree of the module's state. */
+	static void cloneAction(ModuleWidget* mw) {
+		ModuleWidget* clonedModuleWidget = mw->model->createModuleWidget();
+		assert(clonedModuleWidget);
+		engine::ModuleSnapshot s;
+		s.capture(mw->module);
+		s.restore(clonedModuleWidget->module);
+		clonedModuleWidget->module->bypass = s.bypass;
+		// Reset ID so the Engine automatically assigns a new one
+		clonedModuleWidget->module->id = -1;
+
+		APP->scene->rack->addModuleAtMouse(clonedModuleWidget);
+
+		// history::ModuleAdd
+		history::ModuleAdd* h = new history::ModuleAdd;
+		h->name = "clone modules";
+		h->setModule(clonedModuleWidget);
+		APP->history->push(h);
+	}
+};
+
+
+} // namespace app
+} // namespace rack
@@ -0,0 +1,370 @@
+#pragma once
+#include <app/common.hpp>
+#include <app/ModuleWidget.hpp>
+#include <app.hpp>
+#include <history.hpp>
+#include <asset.hpp>
+#include <string.hpp>
+#include <system.hpp>
+#include <plugin/Model.hpp>
+#include <plugin/Plugin.hpp>
+#include <jansson.h>
+#include <sys/stat.h>
+#include <vector>
+#include <map>
+#include <list>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace rack {
+namespace app {
+
+
+/** Indexes module presets on a background thread.
+
+Listing presets and loading one with ModuleWidget::loadAction() reads and parses files on the UI thread.
+The index scans a model's preset directories in the background and caches the metadata of each file until it is modified, so menus and search never touch the disk.
+Call preparse() when the user hovers a preset, so apply() doesn't need to parse it.
+*/
+struct PresetIndex {
+	struct Preset {
+		std::string path;
+		/** The filename without extension */
+		std::string name;
+		/** Slugs stored in the preset, which should match the model */
+		std::string pluginSlug;
+		std::string modelSlug;
+		std::string version;
+		bool user = false;
+		// For detecting modified files
+		int64_t mtime = 0;
+		int64_t size = 0;
+	};
+
+	struct ParsedPreset {
+		std::string path;
+		/** Of the file when it was parsed */
+		int64_t mtime;
+		int64_t size;
+		/** Holds a reference */
+		json_t* moduleJ;
+	};
+
+	/** Maximum number of parsed presets kept for apply() */
+	size_t maxParsed = 8;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	// Guarded by `mutex`
+	std::deque<std::function<void()>> jobs;
+	std::map<const plugin::Model*, std::vector<Preset>> models;
+	std::map<std::string, Preset> fileCache;
+	/** Parsed presets, most recently used first */
+	std::list<ParsedPreset> parsed;
+	bool running = true;
+	std::thread thread;
+
+	PresetIndex() {
+		thread = std::thread([this]() {
+			run();
+		});
+	}
+
+	~PresetIndex() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		cv.notify_one();
+		thread.join();
+		for (ParsedPreset& p : parsed) {
+			json_decref(p.moduleJ);
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&]() {
+				return !running || !jobs.empty();
+			});
+			if (!running)
+				return;
+			std::function<void()> job = std::move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+
+	void push(std::function<void()> job, bool urgent) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (urgent)
+				jobs.push_front(std::move(job));
+			else
+				jobs.push_back(std::move(job));
+		}
+		cv.notify_one();
+	}
+
+	static bool getFileStat(const std::string& path, int64_t* mtime, int64_t* size) {
+		struct stat st;
+		if (stat(path.c_str(), &st))
+			return false;
+		// Nanoseconds where available, so saving twice within a second is detected
+#if defined ARCH_LIN
+		*mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#elif defined ARCH_MAC
+		*mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		*mtime = int64_t(st.st_mtime) * 1000000000;
+#endif
+		*size = st.st_size;
+		return true;
+	}
+
+	/** Reads the metadata of a preset file, or returns false if it can't be parsed. */
+	static bool readPreset(const std::string& path, Preset* preset) {
+		json_error_t error;
+		json_t* moduleJ = json_load_file(path.c_str(), 0, &error);
+		if (!moduleJ) {
+			WARN("Could not parse preset %s: %s %d:%d", path.c_str(), error.text, error.line, error.column);
+			return false;
+		}
+		DEFER({
+			json_decref(moduleJ);
+		});
+		auto getString = [&](const char* key) -> std::string {
+			const char* str = json_string_value(json_object_get(moduleJ, key));
+			return str ? str : "";
+		};
+		preset->pluginSlug = getString("plugin");
+		preset->modelSlug = getString("model");
+		preset->version = getString("version");
+		return true;
+	}
+
+	/** Returns the factory and user preset directories of a model. */
+	static std::vector<std::pair<std::string, bool>> getPresetDirs(plugin::Model* model) {
+		std::vector<std::pair<std::string, bool>> dirs;
+		dirs.push_back(std::make_pair(asset::plugin(model->plugin, "presets/" + model->slug), false));
+		dirs.push_back(std::make_pair(asset::user("presets/" + model->plugin->slug + "/" + model->slug), true));
+		return dirs;
+	}
+
+	/** Rescans the presets of a model in the background.
+	Files which haven't changed since the last scan are not read again.
+	*/
+	void scan(plugin::Model* model) {
+		// Read the model on the calling thread, since plugins may be unloaded later
+		std::vector<std::pair<std::string, bool>> dirs = getPresetDirs(model);
+		std::vector<std::string> extraPaths = model->presetPaths;
+		push([=]() {
+			std::vector<std::pair<std::string, bool>> files;
+			for (const auto& dir : dirs) {
+				if (!system::isDirectory(dir.first))
+					continue;
+				for (const std::string& path : system::getEntries(dir.first)) {
+					if (string::filenameExtension(string::filename(path)) == "vcvm")
+						files.push_back(std::make_pair(path, dir.second));
+				}
+			}
+			for (const std::string& path : extraPaths) {
+				bool found = std::find_if(files.begin(), files.end(), [&](const std::pair<std::string, bool>& file) {
+					return file.first == path;
+				}) != files.end();
+				if (!found)
+					files.push_back(std::make_pair(path, false));
+			}
+
+			std::vector<Preset> presets;
+			for (const auto& file : files) {
+				Preset preset;
+				preset.path = file.first;
+				preset.user = file.second;
+				if (!getFileStat(preset.path, &preset.mtime, &preset.size))
+					continue;
+				bool cached = false;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto it = fileCache.find(preset.path);
+					if (it != fileCache.end() && it->second.mtime == preset.mtime && it->second.size == preset.size) {
+						preset = it->second;
+						cached = true;
+					}
+				}
+				if (!cached) {
+					preset.name = string::filenameBase(string::filename(preset.path));
+					if (!readPreset(preset.path, &preset))
+						continue;
+					std::lock_guard<std::mutex> lock(mutex);
+					fileCache[preset.path] = preset;
+				}
+				presets.push_back(preset);
+			}
+			std::sort(presets.begin(), presets.end(), [](const Preset& a, const Preset& b) {
+				if (a.user != b.user)
+					return !a.user;
+				return a.name < b.name;
+			});
+
+			std::lock_guard<std::mutex> lock(mutex);
+			models[model] = presets;
+		}, false);
+	}
+
+	/** Returns whether the model has finished scanning at least once. */
+	bool isScanned(const plugin::Model* model) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return models.find(model) != models.end();
+	}
+
+	/** Returns the indexed presets of a model, factory presets first. */
+	std::vector<Preset> getPresets(const plugin::Model* model) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = models.find(model);
+		if (it == models.end())
+			return std::vector<Preset>();
+		return it->second;
+	}
+
+	/** Returns the presets of a model whose name matches the query, best match first. */
+	std::vector<Preset> search(const plugin::Model* model, const std::string& query) {
+		std::vector<Preset> presets = getPresets(model);
+		if (query.empty())
+			return presets;
+		std::vector<std::pair<float, Preset>> results;
+		for (const Preset& preset : presets) {
+			float score = string::fuzzyScore(preset.name, query);
+			if (score > 0.f)
+				results.push_back(std::make_pair(score, preset));
+		}
+		std::stable_sort(results.begin(), results.end(), [](const std::pair<float, Preset>& a, const std::pair<float, Preset>& b) {
+			return a.first > b.first;
+		});
+		presets.clear();
+		for (const auto& result : results) {
+			presets.push_back(result.second);
+		}
+		return presets;
+	}
+
+	/** Finds a parsed preset which is still current, and removes it if the file was modified since it was parsed.
+	Call with `mutex` locked.
+	*/
+	std::list<ParsedPreset>::iterator findParsed(const std::string& path, int64_t mtime, int64_t size) {
+		for (auto it = parsed.begin(); it != parsed.end(); it++) {
+			if (it->path != path)
+				continue;
+			if (it->mtime == mtime && it->size == size)
+				return it;
+			json_decref(it->moduleJ);
+			parsed.erase(it);
+			break;
+		}
+		return parsed.end();
+	}
+
+	/** Parses a preset in the background ahead of apply(), e.g. when the user hovers its menu item. */
+	void preparse(const std::string& path) {
+		int64_t mtime, size;
+		if (!getFileStat(path, &mtime, &size))
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = findParsed(path, mtime, size);
+			if (it != parsed.end()) {
+				parsed.splice(parsed.begin(), parsed, it);
+				return;
+			}
+		}
+		push([=]() {
+			// Stat before reading, so a write during parsing makes the entry stale rather than current
+			ParsedPreset p;
+			p.path = path;
+			if (!getFileStat(path, &p.mtime, &p.size))
+				return;
+			json_error_t error;
+			p.moduleJ = json_load_file(path.c_str(), 0, &error);
+			if (!p.moduleJ)
+				return;
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = findParsed(path, p.mtime, p.size);
+			if (it != parsed.end()) {
+				json_decref(it->moduleJ);
+				parsed.erase(it);
+			}
+			parsed.push_front(p);
+			while (parsed.size() > maxParsed) {
+				json_decref(parsed.back().moduleJ);
+				parsed.pop_back();
+			}
+		}, true);
+	}
+
+	/** Returns a new reference to the parsed preset, or NULL if it hasn't been parsed or the file was modified since. */
+	json_t* getParsed(const std::string& path) {
+		int64_t mtime, size;
+		if (!getFileStat(path, &mtime, &size))
+			return NULL;
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = findParsed(path, mtime, size);
+		if (it == parsed.end())
+			return NULL;
+		return json_incref(it->moduleJ);
+	}
+
+	/** Loads a preset into the module with an undo action, like ModuleWidget::loadAction().
+	Uses the preparsed preset if available.
+	Must be called from the UI thread.
+	*/
+	bool apply(ModuleWidget* mw, const std::string& path) {
+		json_t* moduleJ = getParsed(path);
+		if (!moduleJ) {
+			json_error_t error;
+			moduleJ = json_load_file(path.c_str(), 0, &error);
+			if (!moduleJ) {
+				WARN("Could not parse preset %s: %s %d:%d", path.c_str(), error.text, error.line, error.column);
+				return false;
+			}
+		}
+		DEFER({
+			json_decref(moduleJ);
+		});
+
+		const char* modelSlug = json_string_value(json_object_get(moduleJ, "model"));
+		if (modelSlug && mw->model && mw->model->slug != modelSlug) {
+			WARN("Preset %s is for model %s, not %s", path.c_str(), modelSlug, mw->model->slug.c_str());
+			return false;
+		}
+
+		history::ModuleChange* h = new history::ModuleChange;
+		h->name = "load module preset";
+		h->moduleId = mw->module->id;
+		h->oldModuleJ = mw->toJson();
+		mw->fromJson(moduleJ);
+		h->newModuleJ = mw->toJson();
+		APP->history->push(h);
+		return true;
+	}
+};
+
+
+/** Returns the shared index.
+Never destroyed, like engine::getTaskPool().
+*/
+inline PresetIndex& getPresetIndex() {
+	static PresetIndex* index = new PresetIndex;
+	return *index;
+}
+
+
+} // namespace app
+} // namespace rack
@@ -0,0 +1,248 @@
+#pragma once
+#include <app/common.hpp>
+#include <widget/Widget.hpp>
+#include <app/ModuleWidget.hpp>
+#include <app/RackWidget.hpp>
+#include <app/Scene.hpp>
+#include <app.hpp>
+#include <map>
+#include <vector>
+
+
+namespace rack {
+namespace app {
+
+
+/** Index of the rack grid slots taken by modules, for fast collision and nearest-free-slot queries.
+
+RackWidget::requestModulePos() tests a position against every module in the rack, and setModulePosNearest() calls it for many candidate positions, so placing a module is O(n^2) in the number of modules.
+This index stores the occupied column spans of each rack row in a sorted map, so a collision test is O(log n) and a nearest-slot search only visits the spans adjacent to the requested position.
+
+Positions are in grid units, where a column is RACK_GRID_WIDTH and a row is RACK_GRID_HEIGHT pixels.
+Modules are assumed to be one row tall.
+The index must be kept in sync with the widgets by calling add(), remove(), or move() whenever a module's box changes.
+*/
+struct RackOccupancy {
+	struct Slot {
+		int row = 0;
+		int col = 0;
+		int width = 0;
+	};
+
+	/** For each row, maps the first column of each span to its owner. */
+	std::map<int, std::map<int, const widget::Widget*>> rows;
+	std::map<const widget::Widget*, Slot> slots;
+
+	void clear() {
+		rows.clear();
+		slots.clear();
+	}
+
+	/** Rebuilds the index from all children of a container, e.g. RackWidget::moduleContainer.
+	Returns the widgets which start at the same slot as another widget and weren't indexed, e.g. from overlapping positions in a loaded patch.
+	Place them with setModulePosNearest().
+	*/
+	std::vector<widget::Widget*> rebuild(widget::Widget* container) {
+		clear();
+		std::vector<widget::Widget*> rejected;
+		for (widget::Widget* w : container->children) {
+			if (!add(w))
+				rejected.push_back(w);
+		}
+		return rejected;
+	}
+
+	static Slot getSlot(math::Rect box) {
+		Slot slot;
+		slot.col = (int) std::round(box.pos.x / RACK_GRID_WIDTH);
+		slot.row = (int) std::round(box.pos.y / RACK_GRID_HEIGHT);
+		slot.width = std::max((int) std::round(box.size.x / RACK_GRID_WIDTH), 1);
+		return slot;
+	}
+
+	static math::Vec getPos(int row, int col) {
+		return math::Vec(col * RACK_GRID_WIDTH, row * RACK_GRID_HEIGHT);
+	}
+
+	/** Adds a widget at the slot given by its box.
+	Returns false and leaves the widget out of the index if another widget starts at the same slot.
+	*/
+	bool add(const widget::Widget* w) {
+		return add(w, getSlot(w->box));
+	}
+
+	bool add(const widget::Widget* w, Slot slot) {
+		remove(w);
+		auto rowIt = rows.find(slot.row);
+		if (rowIt != rows.end() && rowIt->second.count(slot.col))
+			return false;
+		slots[w] = slot;
+		rows[slot.row][slot.col] = w;
+		return true;
+	}
+
+	void remove(const widget::Widget* w) {
+		auto it = slots.find(w);
+		if (it == slots.end())
+			return;
+		const Slot& slot = it->second;
+		auto rowIt = rows.find(slot.row);
+		if (rowIt != rows.end()) {
+			auto spanIt = rowIt->second.find(slot.col);
+			if (spanIt != rowIt->second.end() && spanIt->second == w)
+				rowIt->second.erase(spanIt);
+			if (rowIt->second.empty())
+				rows.erase(rowIt);
+		}
+		slots.erase(it);
+	}
+
+	/** Call after changing the box of a widget already in the index. */
+	bool move(const widget::Widget* w) {
+		return add(w);
+	}
+
+	int getWidth(const widget::Widget* w) {
+		auto it = slots.find(w);
+		if (it == slots.end())
+			return 0;
+		return it->second.width;
+	}
+
+	/** Returns whether the columns [col, col + width) of a row are free, not counting `ignore`. */
+	bool isFree(int row, int col, int width, const widget::Widget* ignore = NULL) {
+		auto rowIt = rows.find(row);
+		if (rowIt == rows.end())
+			return true;
+		const std::map<int, const widget::Widget*>& spans = rowIt->second;
+		// Check spans starting inside the range
+		for (auto it = spans.lower_bound(col); it != spans.end() && it->first < col + width; it++) {
+			if (it->second != ignore)
+				return false;
+		}
+		// Check spans starting to the left and reaching into the range
+		auto it = spans.lower_bound(col);
+		while (it != spans.begin()) {
+			it--;
+			if (it->second == ignore)
+				continue;
+			return it->first + slots[it->second].width <= col;
+		}
+		return true;
+	}
+
+	/** Finds the free column in a row closest to `col` that fits `width` columns.
+	Returns the distance in columns to the found slot.
+	*/
+	int findNearestCol(int row, int col, int width, const widget::Widget* ignore, int* outCol) {
+		auto rowIt = rows.find(row);
+		if (rowIt == rows.end()) {
+			*outCol = col;
+			return 0;
+		}
+		const std::map<int, const widget::Widget*>& spans = rowIt->second;
+
+		// Search right: push the candidate past every span it collides with
+		int right = col;
+		for (auto it = findFirstReaching(spans, col, ignore); it != spans.end(); it++) {
+			if (it->second == ignore)
+				continue;
+			if (it->first >= right + width)
+				break;
+			right = std::max(right, it->first + slots[it->second].width);
+		}
+
+		// Search left: push the candidate before every span it collides with
+		int left = col;
+		auto it = spans.lower_bound(col + width);
+		while (it != spans.begin()) {
+			it--;
+			if (it->second == ignore)
+				continue;
+			if (it->first + slots[it->second].width <= left)
+				break;
+			left = std::min(left, it->first - width);
+		}
+
+		if (col - left <= right - col) {
+			*outCol = left;
+			return col - left;
+		}
+		*outCol = right;
+		return right - col;
+	}
+
+	/** Finds the free slot closest to (row, col) in pixel distance.
+	Always succeeds since the rack is unbounded.
+	*/
+	void findNearest(int row, int col, int width, const widget::Widget* ignore, int* outRow, int* outCol) {
+		float bestDist = INFINITY;
+		for (int dr = 0; dr * RACK_GRID_HEIGHT < bestDist; dr++) {
+			for (int sign : {1, -1}) {
+				if (dr == 0 && sign < 0)
+					continue;
+				int r = row + sign * dr;
+				int c;
+				int dc = findNearestCol(r, col, width, ignore, &c);
+				float dist = math::Vec(dr * RACK_GRID_HEIGHT, dc * RACK_GRID_WIDTH).norm();
+				if (dist < bestDist) {
+					bestDist = dist;
+					*outRow = r;
+					*outCol = c;
+				}
+			}
+		}
+	}
+
+	// Equivalents of RackWidget methods
+
+	/** Sets a module's box if non-colliding. Returns true if set */
+	bool requestModulePos(widget::Widget* w, math::Vec pos) {
+		Slot slot = getSlot(math::Rect(pos, w->box.size));
+		if (!isFree(slot.row, slot.col, slot.width, w))
+			return false;
+		place(w, slot);
+		return true;
+	}
+
+	/** Moves a module to the closest non-colliding position */
+	void setModulePosNearest(widget::Widget* w, math::Vec pos) {
+		Slot slot = getSlot(math::Rect(pos, w->box.size));
+		findNearest(slot.row, slot.col, slot.width, w, &slot.row, &slot.col);
+		place(w, slot);
+	}
+
+private:
+	/** Moves a widget to a free slot and indexes it.
+	Modules in the rack are moved with RackWidget::setModulePosForce(), which also updates expander adjacency and doesn't displace anything since the slot is free.
+	*/
+	void place(widget::Widget* w, Slot slot) {
+		math::Vec pos = getPos(slot.row, slot.col);
+		ModuleWidget* mw = dynamic_cast<ModuleWidget*>(w);
+		RackWidget* rack = (APP && APP->scene) ? APP->scene->rack : NULL;
+		if (mw && rack && mw->parent == rack->moduleContainer)
+			rack->setModulePosForce(mw, pos);
+		else
+			w->setPosition(pos);
+		add(w, slot);
+	}
+
+	/** Returns the first span which could overlap columns at or after `col`. */
+	std::map<int, const widget::Widget*>::const_iterator findFirstReaching(const std::map<int, const widget::Widget*>& spans, int col, const widget::Widget* ignore) {
+		auto it = spans.lower_bound(col);
+		auto prev = it;
+		while (prev != spans.begin()) {
+			prev--;
+			if (prev->second == ignore)
+				continue;
+			if (prev->first + slots[prev->second].width > col)
+				return prev;
+			break;
+		}
+		return it;
+	}
+};
+
+
+} // namespace app
+} // namespace rack
@@ -0,0 +1,228 @@
+#pragma once
+#include <app/common.hpp>
+#include <app/ModuleWidget.hpp>
+#include <widget/SvgWidget.hpp>
+#include <plugin.hpp>
+#include <system.hpp>
+#include <nanosvgrast.h>
+#include <stb_image_write.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+
+namespace rack {
+namespace app {
+
+
+/** Exports a PNG screenshot of each module panel without an OpenGL context.
+
+Window::screenshot() draws each module with NanoVG on the main thread, which takes minutes for a full plugin library.
+This exporter only uses the main thread to construct each ModuleWidget and collect the Svgs it displays.
+The Svg layers are then rasterized with nanosvgrast on a pool of worker threads and written with stb_image_write.
+
+Screenshots are written to `<outputDir>/<plugin slug>/<model slug>.png`.
+A plugin is skipped if all of its screenshots exist and were exported from the same plugin version.
+
+Only SvgWidgets are drawn, at their unrotated orientation, so widgets drawn with NanoVG (e.g. lights and displays) are missing.
+
+nanosvgrast is not compiled into Rack, so define NANOSVGRAST_IMPLEMENTATION in exactly one of your source files before including <nanosvgrast.h>.
+*/
+struct ScreenshotExporter {
+	std::string outputDir;
+	/** Pixels per SVG pixel */
+	float zoom = 1.f;
+	/** Number of rasterizing threads. If 0, the logical core count is used. */
+	int threadCount = 0;
+
+	struct Layer {
+		/** Held to keep the NSVGimage alive after the widget is deleted. */
+		std::shared_ptr<Svg> svg;
+		/** Position relative to the ModuleWidget */
+		math::Vec pos;
+	};
+
+	struct Job {
+		std::string path;
+		math::Vec size;
+		std::vector<Layer> layers;
+	};
+
+	static std::string getVersionPath(const std::string& pluginDir) {
+		return pluginDir + "/.version";
+	}
+
+	static std::string readFile(const std::string& path) {
+		std::string s;
+		FILE* file = std::fopen(path.c_str(), "rb");
+		if (!file)
+			return s;
+		DEFER({
+			std::fclose(file);
+		});
+		char buf[256];
+		size_t n;
+		while ((n = std::fread(buf, 1, sizeof(buf), file)) > 0) {
+			s.append(buf, n);
+		}
+		return s;
+	}
+
+	static void writeFile(const std::string& path, const std::string& s) {
+		FILE* file = std::fopen(path.c_str(), "wb");
+		if (!file)
+			return;
+		std::fwrite(s.data(), 1, s.size(), file);
+		std::fclose(file);
+	}
+
+	/** Returns whether the plugin's screenshots were exported from its current version. */
+	bool isCached(plugin::Plugin* plugin) {
+		std::string pluginDir = outputDir + "/" + plugin->slug;
+		if (readFile(getVersionPath(pluginDir)) != plugin->version)
+			return false;
+		for (plugin::Model* model : plugin->models) {
+			if (!system::isFile(pluginDir + "/" + model->slug + ".png"))
+				return false;
+		}
+		return true;
+	}
+
+	static void collectLayers(widget::Widget* w, widget::Widget* root, std::vector<Layer>& layers) {
+		if (!w->visible)
+			return;
+		widget::SvgWidget* sw = dynamic_cast<widget::SvgWidget*>(w);
+		if (sw && sw->svg && sw->svg->handle) {
+			Layer layer;
+			layer.svg = sw->svg;
+			layer.pos = sw->getRelativeOffset(math::Vec(), root);
+			layers.push_back(layer);
+		}
+		for (widget::Widget* child : w->children) {
+			collectLayers(child, root, layers);
+		}
+	}
+
+	/** Constructs the model's ModuleWidget and collects its Svg layers.
+	Must be called on the main thread.
+	*/
+	static bool createJob(plugin::Model* model, const std::string& path, Job& job) {
+		ModuleWidget* mw = model->createModuleWidgetNull();
+		if (!mw)
+			return false;
+		DEFER({
+			delete mw;
+		});
+		job.path = path;
+		job.size = mw->box.size;
+		job.layers.clear();
+		collectLayers(mw, mw, job.layers);
+		return true;
+	}
+
+	/** Rasterizes and writes a job's PNG.
+	Thread-safe, as long as each thread uses its own rasterizer.
+	*/
+	static bool render(NSVGrasterizer* rast, const Job& job, float zoom) {
+		int width = (int) std::ceil(job.size.x * zoom);
+		int height = (int) std::ceil(job.size.y * zoom);
+		if (width <= 0 || height <= 0)
+			return false;
+		std::vector<uint8_t> image(width * height * 4, 0);
+		std::vector<uint8_t> layerImage(width * height * 4);
+
+		for (const Layer& layer : job.layers) {
+			math::Vec pos = layer.pos.mult(zoom);
+			nsvgRasterize(rast, layer.svg->handle, pos.x, pos.y, zoom, layerImage.data(), width, height, width * 4);
+			// Composite non-premultiplied layer over image
+			for (int i = 0; i < width * height; i++) {
+				uint8_t* src = &layerImage[i * 4];
+				uint8_t* dst = &image[i * 4];
+				float srcA = src[3] / 255.f;
+				if (srcA <= 0.f)
+					continue;
+				float dstA = dst[3] / 255.f;
+				float outA = srcA + dstA * (1.f - srcA);
+				for (int c = 0; c < 3; c++) {
+					float out = (src[c] * srcA + dst[c] * dstA * (1.f - srcA)) / outA;
+					dst[c] = (uint8_t) math::clamp(out + 0.5f, 0.f, 255.f);
+				}
+				dst[3] = (uint8_t) math::clamp(outA * 255.f + 0.5f, 0.f, 255.f);
+			}
+		}
+
+		return stbi_write_png(job.path.c_str(), width, height, 4, image.data(), width * 4) != 0;
+	}
+
+	/** Exports screenshots of all models of the given plugins.
+	Must be called on the main thread. Returns the number of screenshots written.
+	*/
+	int exportPlugins(const std::vector<plugin::Plugin*>& plugins) {
+		if (!system::isDirectory(outputDir))
+			system::createDirectory(outputDir);
+
+		// Collect jobs on the main thread, since constructing widgets is not thread-safe
+		std::vector<Job> jobs;
+		std::vector<plugin::Plugin*> exportedPlugins;
+		for (plugin::Plugin* plugin : plugins) {
+			if (isCached(plugin)) {
+				INFO("Skipping screenshots of plugin %s %s, already exported", plugin->slug.c_str(), plugin->version.c_str());
+				continue;
+			}
+			std::string pluginDir = outputDir + "/" + plugin->slug;
+			if (!system::isDirectory(pluginDir))
+				system::createDirectory(pluginDir);
+			for (plugin::Model* model : plugin->models) {
+				Job job;
+				if (createJob(model, pluginDir + "/" + model->slug + ".png", job))
+					jobs.push_back(job);
+			}
+			exportedPlugins.push_back(plugin);
+		}
+
+		// Rasterize on worker threads
+		std::atomic<size_t> nextJob(0);
+		std::atomic<int> written(0);
+		auto workerRun = [&]() {
+			NSVGrasterizer* rast = nsvgCreateRasterizer();
+			DEFER({
+				nsvgDeleteRasterizer(rast);
+			});
+			size_t i;
+			while ((i = nextJob++) < jobs.size()) {
+				if (render(rast, jobs[i], zoom))
+					written++;
+				else
+					WARN("Could not write screenshot %s", jobs[i].path.c_str());
+			}
+		};
+		int threads = (threadCount > 0) ? threadCount : system::getLogicalCoreCount();
+		threads = math::clamp(threads, 1, std::max((int) jobs.size(), 1));
+		std::vector<std::thread> workers;
+		for (int i = 1; i < threads; i++) {
+			workers.emplace_back(workerRun);
+		}
+		workerRun();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		// Mark plugins as cached once all of their screenshots exist
+		for (plugin::Plugin* plugin : exportedPlugins) {
+			std::string pluginDir = outputDir + "/" + plugin->slug;
+			writeFile(getVersionPath(pluginDir), plugin->version);
+			if (!isCached(plugin))
+				writeFile(getVersionPath(pluginDir), "");
+		}
+		return written;
+	}
+
+	/** Exports screenshots of all loaded plugins. */
+	int exportAll() {
+		return exportPlugins(plugin::plugins);
+	}
+};
+
+
+} // namespace app
+} // namespace rack
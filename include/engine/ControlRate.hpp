@@ -0,0 +1,77 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <dsp/digital.hpp>
+#include <vector>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Calls the process() method of TModule once every `Division` samples, for modules which don't need audio-rate updates, e.g. LFOs, sequencers, and MIDI-CC.
+
+	Model* modelLFO = createModel<ControlRate<LFO, 32, true>, LFOWidget>("LFO");
+
+TModule::process() receives ProcessArgs with the divided sample rate, so code which uses `args.sampleRate` or `args.sampleTime` works unchanged.
+APP->engine->getSampleRate() still returns the full rate, e.g. in onSampleRateChange(), so a module which computes coefficients from it must divide it by `Division` itself.
+Between calls, outputs hold their values, or if `Interpolate` is true, ramp linearly to them over one period, which delays outputs by one period.
+Inputs are only read every `Division` samples, so triggers shorter than a period can be missed, and MIDI messages are delayed by up to a period.
+*/
+template <class TModule, int Division = 32, bool Interpolate = false>
+struct ControlRate : TModule {
+	dsp::ClockDivider divider;
+
+	struct OutputState {
+		float from[PORT_MAX_CHANNELS] = {};
+		float to[PORT_MAX_CHANNELS] = {};
+		int channels = 0;
+	};
+	/** Only used when interpolating */
+	std::vector<OutputState> outputStates;
+
+	ControlRate() {
+		divider.setDivision(Division);
+		// Outputs are configured by the TModule constructor
+		if (Interpolate)
+			outputStates.resize(this->outputs.size());
+	}
+
+	void process(const Module::ProcessArgs& args) override {
+		if (divider.process()) {
+			int division = divider.getDivision();
+			Module::ProcessArgs controlArgs = args;
+			controlArgs.sampleRate /= division;
+			controlArgs.sampleTime *= division;
+			TModule::process(controlArgs);
+
+			for (size_t i = 0; i < outputStates.size(); i++) {
+				OutputState& state = outputStates[i];
+				Output& output = this->outputs[i];
+				int channels = output.getChannels();
+				for (int c = 0; c < channels; c++) {
+					// Jump to new channels instead of ramping from stale values
+					state.from[c] = (c < state.channels) ? state.to[c] : output.voltages[c];
+					state.to[c] = output.voltages[c];
+				}
+				state.channels = channels;
+			}
+		}
+
+		if (Interpolate) {
+			// Reaches the latest values on the last sample of the period
+			float t = float(divider.getClock() + 1) / divider.getDivision();
+			for (size_t i = 0; i < outputStates.size(); i++) {
+				OutputState& state = outputStates[i];
+				Output& output = this->outputs[i];
+				for (int c = 0; c < state.channels; c++) {
+					output.voltages[c] = state.from[c] + (state.to[c] - state.from[c]) * t;
+				}
+			}
+		}
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
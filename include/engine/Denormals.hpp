@@ -0,0 +1,158 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <plugin/Model.hpp>
+#include <plugin/Plugin.hpp>
+#include <pmmintrin.h>
+#include <atomic>
+#include <mutex>
+#include <map>
+
+
+namespace rack {
+namespace engine {
+
+
+/** MXCSR bits */
+static const uint32_t MXCSR_DENORMAL_FLAG = 1 << 1;
+static const uint32_t MXCSR_UNDERFLOW_FLAG = 1 << 4;
+static const uint32_t MXCSR_FLAGS = 0x3f;
+static const uint32_t MXCSR_DAZ = 1 << 6;
+static const uint32_t MXCSR_FTZ = 1 << 15;
+
+
+/** Returns whether the calling thread flushes denormal results to zero (FTZ) and treats denormal inputs as zero (DAZ). */
+inline bool isFlushingDenormals() {
+	return (_mm_getcsr() & (MXCSR_FTZ | MXCSR_DAZ)) == (MXCSR_FTZ | MXCSR_DAZ);
+}
+
+/** Enables or disables FTZ and DAZ on the calling thread.
+Arithmetic on denormals is 10-100x slower than on normal floats, which causes CPU spikes when filters and reverbs decay to silence.
+The engine enables FTZ and DAZ on its own threads, so only call this from threads you create (e.g. a worker thread which runs DSP).
+*/
+inline void setFlushDenormals(bool flush) {
+	uint32_t csr = _mm_getcsr();
+	if (flush)
+		csr |= MXCSR_FTZ | MXCSR_DAZ;
+	else
+		csr &= ~(MXCSR_FTZ | MXCSR_DAZ);
+	_mm_setcsr(csr);
+}
+
+/** Enables FTZ and DAZ if they aren't already.
+Reading MXCSR is much cheaper than writing it, so this is cheap enough to call once per block.
+*/
+inline void ensureFlushDenormals() {
+	uint32_t csr = _mm_getcsr();
+	if ((csr & (MXCSR_FTZ | MXCSR_DAZ)) != (MXCSR_FTZ | MXCSR_DAZ))
+		_mm_setcsr(csr | MXCSR_FTZ | MXCSR_DAZ);
+}
+
+
+/** Enables FTZ and DAZ until the scope ends, e.g. in a callback of a thread you don't own. */
+struct FlushDenormalsScope {
+	uint32_t previous;
+
+	FlushDenormalsScope() {
+		previous = _mm_getcsr();
+		_mm_setcsr(previous | MXCSR_FTZ | MXCSR_DAZ);
+	}
+	~FlushDenormalsScope() {
+		// Restore the mode but keep the exception flags raised in the scope
+		_mm_setcsr((previous & ~MXCSR_FLAGS) | (_mm_getcsr() & MXCSR_FLAGS));
+	}
+};
+
+
+/** Collects how often each model produces or consumes denormals. */
+struct DenormalMonitor {
+	struct Stats {
+		/** Number of sampled process() calls */
+		std::atomic<uint64_t> samples{0};
+		/** Number of sampled process() calls which raised the denormal or underflow flag */
+		std::atomic<uint64_t> hits{0};
+	};
+
+	std::atomic<bool> enabled{true};
+	/** Checks one in this many process() calls of each module */
+	int interval = 64;
+
+	std::mutex mutex;
+	/** Never freed, so modules can keep pointers to their Stats. */
+	std::map<const plugin::Model*, Stats*> stats;
+
+	Stats* getStats(const plugin::Model* model) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Stats*& s = stats[model];
+		if (!s)
+			s = new Stats;
+		return s;
+	}
+
+	/** Logs the models which raised denormal flags, most frequent first. */
+	void log() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::multimap<double, const plugin::Model*> ranking;
+		for (auto& pair : stats) {
+			uint64_t samples = pair.second->samples;
+			uint64_t hits = pair.second->hits;
+			if (samples > 0 && hits > 0)
+				ranking.insert(std::make_pair(double(hits) / samples, pair.first));
+		}
+		for (auto it = ranking.rbegin(); it != ranking.rend(); it++) {
+			const plugin::Model* model = it->second;
+			std::string slug = model ? ((model->plugin ? model->plugin->slug : "") + "/" + model->slug) : "unknown module";
+			INFO("%s raised denormal flags in %.1f%% of sampled frames", slug.c_str(), it->first * 100.0);
+		}
+	}
+};
+
+
+inline DenormalMonitor& getDenormalMonitor() {
+	// Never destroyed, since modules may be processed during static destruction
+	static DenormalMonitor* monitor = new DenormalMonitor;
+	return *monitor;
+}
+
+
+/** Reports denormals produced or consumed by the process() method of TModule to the DenormalMonitor.
+Wrap a module when creating its Model.
+
+	Model* modelMyModule = createModel<DenormalChecked<MyModule>, MyModuleWidget>("MyModule");
+
+With FTZ, flushed results raise the underflow flag. With DAZ, denormal inputs raise no flag, but they can only come from threads without FTZ.
+*/
+template <class TModule>
+struct DenormalChecked : TModule {
+	DenormalMonitor::Stats* denormalStats = NULL;
+	int denormalFrame = 0;
+
+	void onAdd() override {
+		// Resolved here since getStats() locks and allocates
+		denormalStats = getDenormalMonitor().getStats(this->model);
+		TModule::onAdd();
+	}
+
+	void process(const Module::ProcessArgs& args) override {
+		DenormalMonitor& monitor = getDenormalMonitor();
+		if (!denormalStats || !monitor.enabled || ++denormalFrame < monitor.interval) {
+			TModule::process(args);
+			return;
+		}
+		denormalFrame = 0;
+
+		uint32_t csr = _mm_getcsr();
+		_mm_setcsr(csr & ~MXCSR_FLAGS);
+		TModule::process(args);
+		uint32_t flags = _mm_getcsr() & MXCSR_FLAGS;
+		_mm_setcsr(csr | flags);
+
+		denormalStats->samples++;
+		if (flags & (MXCSR_DENORMAL_FLAG | MXCSR_UNDERFLOW_FLAG))
+			denormalStats->hits++;
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
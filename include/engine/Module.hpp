@@ -1,6 +1,7 @@
 #pragma once
 #include <common.hpp>
 #include <string.hpp>
+#include <random.hpp>
 #include <plugin/Model.hpp>
 #include <engine/Param.hpp>
 #include <engine/Port.hpp>
@@ -117,6 +118,23 @@ struct Module {
 		paramQuantities[paramId] = q;
 	}
 
+	/** Seeds a random generator with a stream unique to this module.
+	The random:: functions share one state per engine thread, so modules drawing from them are correlated by their thread assignment and are not reproducible.
+	Keep a generator in your Module and seed it in onAdd(), once the module ID is assigned.
+	Since the ID is saved in the patch, the module generates the same sequence each time the patch is loaded.
+	Example:
+
+		random::Xoshiro128Plus_4 rng;
+
+		void onAdd() override {
+			seedRandom(rng);
+		}
+	*/
+	template <typename T>
+	void seedRandom(random::TXoshiro128Plus<T>& g, uint64_t seed = 0) {
+		g.seed(seed, id);
+	}
+
 	struct ProcessArgs {
 		float sampleRate;
 		float sampleTime;
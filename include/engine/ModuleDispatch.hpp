@@ -0,0 +1,167 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <engine/TaskPool.hpp>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Implement this interface in a Module whose onSampleRateChange() and onReset() may run concurrently with those of other modules, including other instances of its Model.
+Module events are otherwise called one at a time, so modules may share state between instances, e.g. a lazily built static table.
+
+	struct MyModule : Module, ConcurrentEventsModule {
+		...
+	};
+*/
+struct ConcurrentEventsModule {
+	virtual ~ConcurrentEventsModule() {}
+};
+
+
+/** Calls `f(module)` for each module on the calling thread and the threads of `pool`, and returns when all calls return.
+Modules are claimed one at a time, so a few slow modules don't hold up the rest.
+`f` must be safe to call for different modules concurrently.
+*/
+inline void forEachModuleParallel(const std::vector<Module*>& modules, const std::function<void(Module*)>& f, TaskPool* pool = &getTaskPool()) {
+	int jobCount = std::min((int) pool->threads.size(), (int) modules.size() - 1);
+	if (jobCount <= 0) {
+		for (Module* module : modules) {
+			f(module);
+		}
+		return;
+	}
+
+	// Shared with the jobs, since a job may start after all modules are done
+	struct State {
+		std::vector<Module*> modules;
+		std::function<void(Module*)> f;
+		std::atomic<size_t> next{0};
+		std::mutex mutex;
+		std::condition_variable cv;
+		/** Guarded by `mutex` */
+		size_t remaining;
+
+		void run() {
+			size_t i;
+			while ((i = next++) < modules.size()) {
+				f(modules[i]);
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--remaining == 0)
+					cv.notify_all();
+			}
+		}
+	};
+	std::shared_ptr<State> state = std::make_shared<State>();
+	state->modules = modules;
+	state->f = f;
+	state->remaining = modules.size();
+	for (int i = 0; i < jobCount; i++) {
+		pool->submit([state]() {
+			state->run();
+		});
+	}
+	state->run();
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cv.wait(lock, [&]() {
+		return state->remaining == 0;
+	});
+}
+
+
+/** Calls `f(module)` for each module, in parallel for modules which implement ConcurrentEventsModule and in order on the calling thread for the rest. */
+inline void dispatchEvent(const std::vector<Module*>& modules, const std::function<void(Module*)>& f) {
+	std::vector<Module*> concurrent;
+	for (Module* module : modules) {
+		if (dynamic_cast<ConcurrentEventsModule*>(module))
+			concurrent.push_back(module);
+		else
+			f(module);
+	}
+	forEachModuleParallel(concurrent, f);
+}
+
+
+/** Calls onSampleRateChange() of each module, in parallel for modules which implement ConcurrentEventsModule.
+Modules which rebuild filters or tables when the sample rate changes take most of the time of a sample rate change, and they are independent of each other.
+Call it while the modules are not being processed, as the Engine does.
+*/
+inline void dispatchSampleRateChange(const std::vector<Module*>& modules) {
+	dispatchEvent(modules, [](Module* module) {
+		module->onSampleRateChange();
+	});
+}
+
+
+/** Calls onReset() of each module, in parallel for modules which implement ConcurrentEventsModule.
+Like dispatchSampleRateChange(), call it while the modules are not being processed.
+*/
+inline void dispatchReset(const std::vector<Module*>& modules) {
+	dispatchEvent(modules, [](Module* module) {
+		module->onReset();
+	});
+}
+
+
+/** A gain which ramps to 0 while a module's state is being rebuilt and back to 1 when it's ready, so outputs don't click or play garbage.
+
+For example, rebuild a table in the background when the sample rate changes, using a TaskGroup.
+
+	void onSampleRateChange() override {
+		fader.mute();
+		tableTasks.submit(...);
+	}
+
+	void process(const ProcessArgs& args) override {
+		// Swap only once the output is silent
+		if (fader.isSilent()) {
+			tableTasks.poll([&](Table& table) {
+				std::swap(this->table, table);
+				fader.unmute();
+			});
+		}
+		float gain = fader.process(args.sampleTime);
+		...
+	}
+*/
+struct MuteFader {
+	/** Duration of a full ramp, in seconds */
+	float time = 0.01f;
+	float gain = 1.f;
+	/** Set by any thread, read by process() */
+	std::atomic<bool> muted{false};
+
+	void mute() {
+		muted = true;
+	}
+	void unmute() {
+		muted = false;
+	}
+
+	/** Returns whether the ramp to 0 has finished, so the state may be swapped without a click. */
+	bool isSilent() const {
+		return gain <= 0.f;
+	}
+
+	/** Advances the ramp by one sample and returns the gain. */
+	float process(float sampleTime) {
+		float delta = sampleTime / time;
+		if (muted.load(std::memory_order_relaxed))
+			gain = std::max(gain - delta, 0.f);
+		else
+			gain = std::min(gain + delta, 1.f);
+		return gain;
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
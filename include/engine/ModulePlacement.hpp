@@ -0,0 +1,242 @@
+#pragma once
+#include <common.hpp>
+#include <system.hpp>
+#include <string.hpp>
+#include <engine/Module.hpp>
+#include <engine/Cable.hpp>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#if defined ARCH_LIN
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+
+namespace rack {
+namespace engine {
+
+
+/** The NUMA node of each logical CPU.
+Only detected on Linux. Other platforms report a single node.
+*/
+struct CpuTopology {
+	std::vector<int> cpuNodes;
+
+	CpuTopology() {
+		int cpuCount = std::max(1, (int) std::thread::hardware_concurrency());
+		cpuNodes.assign(cpuCount, 0);
+#if defined ARCH_LIN
+		for (int cpu = 0; cpu < cpuCount; cpu++) {
+			std::string dir = string::f("/sys/devices/system/cpu/cpu%d", cpu);
+			if (!system::isDirectory(dir))
+				continue;
+			for (const std::string& entry : system::getEntries(dir)) {
+				std::string name = string::filename(entry);
+				if (string::startsWith(name, "node"))
+					cpuNodes[cpu] = std::atoi(name.c_str() + 4);
+			}
+		}
+#endif
+	}
+
+	int getNodeCount() const {
+		return *std::max_element(cpuNodes.begin(), cpuNodes.end()) + 1;
+	}
+
+	std::vector<int> getNodeCpus(int node) const {
+		std::vector<int> cpus;
+		for (int cpu = 0; cpu < (int) cpuNodes.size(); cpu++) {
+			if (cpuNodes[cpu] == node)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+};
+
+
+inline const CpuTopology& getCpuTopology() {
+	static const CpuTopology topology;
+	return topology;
+}
+
+
+/** Restricts the calling thread to the given logical CPUs.
+Returns false if unsupported, which is currently the case on Mac and Windows.
+*/
+inline bool setThreadAffinity(const std::vector<int>& cpus) {
+#if defined ARCH_LIN
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+
+/** Runs `f` on a temporary thread restricted to the CPUs of a NUMA node, and waits for it to return.
+Linux places memory on the node of the thread which first writes it, so allocating and initializing state within `f` keeps it on that node.
+For example, allocate a worker's buffers within `f` and write them with touchPages().
+Memory which is freed and reused later, e.g. by a shared allocator, can end up in use on any node.
+*/
+inline void runOnNode(int node, const std::function<void()>& f) {
+	std::thread thread([&]() {
+		setThreadAffinity(getCpuTopology().getNodeCpus(node));
+		f();
+	});
+	thread.join();
+}
+
+
+/** Writes every page of a buffer without changing its contents, so the pages are placed on the calling thread's NUMA node instead of the node of the thread which first touches them later. */
+inline void touchPages(void* p, size_t size) {
+	const uintptr_t pageSize = 4096;
+	if (size == 0)
+		return;
+	uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+	uintptr_t last = begin + size - 1;
+	// Write within the buffer on each page from the page containing `p` to the page containing its last byte
+	for (uintptr_t page = begin & ~(pageSize - 1); page <= last; page += pageSize) {
+		volatile char* c = reinterpret_cast<char*>(std::max(page, begin));
+		*c = *c;
+	}
+}
+
+
+/** Assigns modules to workers, keeping connected modules together and assignments stable.
+
+Modules are ordered by a breadth-first walk of the cable graph, so connected modules are adjacent, and the order is cut into contiguous segments of similar Module::cpuTime.
+Existing assignments are kept until the busiest worker exceeds the average load by `imbalance`, so modules don't migrate between workers and caches every time the patch changes.
+
+The Engine's scheduler is in libRack and distributes modules itself. This class is for plugins and hosts which process modules on their own threads, e.g. one TopologicalProcessor per worker pinned with setThreadAffinity().
+*/
+struct ModulePlacement {
+	int workerCount = 1;
+	/** Fraction above the average load which triggers a rebalance */
+	float imbalance = 0.25f;
+	/** Load of a module without measured CPU time, so unmeasured modules are spread too. */
+	float minCost = 1e-6f;
+	std::map<const Module*, int> workers;
+
+	/** Returns the worker of a module, or -1 if it isn't placed. */
+	int getWorker(const Module* module) const {
+		auto it = workers.find(module);
+		if (it == workers.end())
+			return -1;
+		return it->second;
+	}
+
+	float getCost(const Module* module) const {
+		return std::max(module->cpuTime, minCost);
+	}
+
+	/** Returns the modules in breadth-first order of the cable graph, starting each connected group at its lowest module ID. */
+	static std::vector<Module*> getConnectedOrder(const std::vector<Module*>& modules, const std::vector<Cable*>& cables) {
+		std::map<const Module*, std::vector<Module*>> neighbors;
+		for (Cable* cable : cables) {
+			neighbors[cable->outputModule].push_back(cable->inputModule);
+			neighbors[cable->inputModule].push_back(cable->outputModule);
+		}
+		auto byId = [](const Module* a, const Module* b) {
+			return a->id < b->id;
+		};
+		std::vector<Module*> sorted = modules;
+		std::sort(sorted.begin(), sorted.end(), byId);
+		std::set<const Module*> known(modules.begin(), modules.end());
+
+		std::vector<Module*> order;
+		std::set<const Module*> visited;
+		for (Module* start : sorted) {
+			if (visited.count(start))
+				continue;
+			std::deque<Module*> queue;
+			queue.push_back(start);
+			visited.insert(start);
+			while (!queue.empty()) {
+				Module* module = queue.front();
+				queue.pop_front();
+				order.push_back(module);
+				std::vector<Module*>& next = neighbors[module];
+				std::sort(next.begin(), next.end(), byId);
+				for (Module* other : next) {
+					if (!known.count(other) || visited.count(other))
+						continue;
+					visited.insert(other);
+					queue.push_back(other);
+				}
+			}
+		}
+		return order;
+	}
+
+	/** Updates the assignment for the current modules and cables.
+	Returns true if all modules were reassigned, rather than only added or removed.
+	*/
+	bool update(const std::vector<Module*>& modules, const std::vector<Cable*>& cables) {
+		workerCount = std::max(workerCount, 1);
+		float total = 0.f;
+		for (Module* module : modules) {
+			total += getCost(module);
+		}
+		float average = total / workerCount;
+
+		// Keep existing assignments and place new modules with a connected module, or on the least loaded worker
+		std::map<const Module*, int> kept;
+		std::vector<float> loads(workerCount, 0.f);
+		std::vector<Module*> added;
+		for (Module* module : modules) {
+			int worker = getWorker(module);
+			if (worker >= 0 && worker < workerCount) {
+				kept[module] = worker;
+				loads[worker] += getCost(module);
+			}
+			else {
+				added.push_back(module);
+			}
+		}
+		for (Module* module : added) {
+			int worker = -1;
+			for (Cable* cable : cables) {
+				const Module* other = (cable->inputModule == module) ? cable->outputModule : (cable->outputModule == module) ? cable->inputModule : NULL;
+				auto it = other ? kept.find(other) : kept.end();
+				if (it != kept.end() && loads[it->second] + getCost(module) <= average * (1.f + imbalance)) {
+					worker = it->second;
+					break;
+				}
+			}
+			if (worker < 0)
+				worker = std::min_element(loads.begin(), loads.end()) - loads.begin();
+			kept[module] = worker;
+			loads[worker] += getCost(module);
+		}
+		if (added.size() < modules.size() && *std::max_element(loads.begin(), loads.end()) <= average * (1.f + imbalance)) {
+			workers = kept;
+			return false;
+		}
+
+		// Rebalance by cutting the connected order into segments of equal load
+		workers.clear();
+		float sum = 0.f;
+		for (Module* module : getConnectedOrder(modules, cables)) {
+			float cost = getCost(module);
+			// Assign by the midpoint of the module's cost, so segments are balanced
+			int worker = std::min(int((sum + cost / 2) / total * workerCount), workerCount - 1);
+			workers[module] = worker;
+			sum += cost;
+		}
+		return true;
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
@@ -0,0 +1,107 @@
+#pragma once
+#include <common.hpp>
+#include <vector>
+#include <mutex>
+#include <new>
+
+
+namespace rack {
+namespace engine {
+
+
+/** A free list of fixed-size memory blocks. Thread-safe. */
+struct BlockPool {
+	size_t blockSize;
+	/** Maximum number of free blocks kept for reuse. Freed blocks beyond this are returned to the system. */
+	size_t maxFree = 32;
+	std::vector<void*> freeBlocks;
+	std::mutex mutex;
+
+	// Statistics
+	size_t allocated = 0;
+	size_t recycled = 0;
+
+	explicit BlockPool(size_t blockSize) : blockSize(blockSize) {}
+
+	~BlockPool() {
+		for (void* p : freeBlocks) {
+			::operator delete(p);
+		}
+	}
+
+	void* allocate() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			allocated++;
+			if (!freeBlocks.empty()) {
+				void* p = freeBlocks.back();
+				freeBlocks.pop_back();
+				recycled++;
+				return p;
+			}
+		}
+		return ::operator new(blockSize);
+	}
+
+	void deallocate(void* p) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (freeBlocks.size() < maxFree) {
+				freeBlocks.push_back(p);
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+	/** Allocates blocks ahead of time, e.g. before browsing presets of a model. */
+	void reserve(size_t count) {
+		std::lock_guard<std::mutex> lock(mutex);
+		while (freeBlocks.size() < std::min(count, maxFree)) {
+			freeBlocks.push_back(::operator new(blockSize));
+		}
+	}
+};
+
+
+/** Recycles the memory of deleted instances of T.
+
+Cloning, undo/redo, and browsing presets create and delete many instances of the same Module, which churns the allocator and fragments the heap.
+Inherit this class to give T a per-class pool, e.g.
+
+	struct MyModule : Module, PoolAllocated<MyModule> {
+		...
+	};
+
+This also works for ParamQuantity subclasses created with configParam<MyParamQuantity>().
+Only the instance itself is pooled. The vectors allocated by Module::config() and the default ParamQuantity are allocated by Rack and can't be pooled from a plugin.
+Subclasses of T larger than T fall back to the global allocator.
+*/
+template <class T>
+struct PoolAllocated {
+	static BlockPool& getPool() {
+		// Never destroyed, since instances may be deleted during static destruction
+		static BlockPool* pool = new BlockPool(sizeof(T));
+		return *pool;
+	}
+
+	static void* operator new(size_t size) {
+		if (size != sizeof(T))
+			return ::operator new(size);
+		return getPool().allocate();
+	}
+
+	static void operator delete(void* p, size_t size) {
+		if (!p)
+			return;
+		if (size != sizeof(T)) {
+			::operator delete(p);
+			return;
+		}
+		getPool().deallocate(p);
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
@@ -0,0 +1,264 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <plugin/Model.hpp>
+#include <plugin/Plugin.hpp>
+#include <engine/Engine.hpp>
+#include <jansson.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <string>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Implement this interface in a Module to copy its state in binary form within the process.
+Modules with large data (e.g. samples) encode it with dataToJson() as base64 strings, which is slow to copy.
+Snapshots use these methods instead of dataToJson() and dataFromJson() when the Module implements them.
+
+	struct MyModule : Module, BinaryStateModule {
+		...
+	};
+
+JSON is still used for saving patches and for the system clipboard.
+*/
+struct BinaryStateModule {
+	virtual ~BinaryStateModule() {}
+	/** Appends the module's data to `data`. */
+	virtual void dataToBinary(std::vector<uint8_t>& data) = 0;
+	/** Restores the data written by dataToBinary(). */
+	virtual void dataFromBinary(const std::vector<uint8_t>& data) = 0;
+};
+
+
+/** The state of a Module's params, bypass, and data.
+Restoring a snapshot writes the state directly into an existing Module, which is much faster than rebuilding the module from JSON.
+*/
+struct ModuleSnapshot {
+	int moduleId = -1;
+	/** Slugs of the module's Model, or empty if unknown */
+	std::string pluginSlug;
+	std::string modelSlug;
+	std::vector<float> params;
+	bool bypass = false;
+	/** The module's "data" object, or NULL. Owned. */
+	json_t* dataJ = NULL;
+	/** The module's binary data if it implements BinaryStateModule, or NULL. Immutable, so copies of the snapshot share it. */
+	std::shared_ptr<const std::vector<uint8_t>> binary;
+
+	ModuleSnapshot() {}
+	ModuleSnapshot(const ModuleSnapshot& other) {
+		*this = other;
+	}
+	ModuleSnapshot& operator=(const ModuleSnapshot& other) {
+		if (this == &other)
+			return *this;
+		moduleId = other.moduleId;
+		pluginSlug = other.pluginSlug;
+		modelSlug = other.modelSlug;
+		params = other.params;
+		bypass = other.bypass;
+		setData(other.dataJ ? json_incref(other.dataJ) : NULL);
+		binary = other.binary;
+		return *this;
+	}
+	~ModuleSnapshot() {
+		setData(NULL);
+	}
+
+	/** Takes ownership of `dataJ`. */
+	void setData(json_t* dataJ) {
+		if (this->dataJ)
+			json_decref(this->dataJ);
+		this->dataJ = dataJ;
+	}
+
+	void capture(Module* module) {
+		moduleId = module->id;
+		pluginSlug = module->model ? module->model->plugin->slug : "";
+		modelSlug = module->model ? module->model->slug : "";
+		params.resize(module->params.size());
+		for (size_t i = 0; i < params.size(); i++) {
+			params[i] = module->params[i].getValue();
+		}
+		bypass = module->bypass;
+		BinaryStateModule* binaryModule = dynamic_cast<BinaryStateModule*>(module);
+		if (binaryModule) {
+			std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>();
+			binaryModule->dataToBinary(*data);
+			binary = data;
+			setData(NULL);
+		}
+		else {
+			binary = NULL;
+			setData(module->dataToJson());
+		}
+	}
+
+	/** Returns whether the snapshot was taken from a module of the same Model.
+	Snapshots without slugs match any module.
+	*/
+	bool matches(const Module* module) const {
+		if (modelSlug.empty() || !module->model)
+			return true;
+		return module->model->slug == modelSlug && module->model->plugin->slug == pluginSlug;
+	}
+
+	/** Writes the snapshot into the module.
+	Like Module::fromJson(), this should be called from the UI thread.
+	*/
+	void restore(Module* module) const {
+		size_t count = std::min(params.size(), module->params.size());
+		for (size_t i = 0; i < count; i++) {
+			// Params missing from a parsed patch are NAN
+			if (std::isfinite(params[i]))
+				module->params[i].setValue(params[i]);
+		}
+		BinaryStateModule* binaryModule = binary ? dynamic_cast<BinaryStateModule*>(module) : NULL;
+		if (binaryModule)
+			binaryModule->dataFromBinary(*binary);
+		else if (dataJ)
+			module->dataFromJson(dataJ);
+	}
+
+	/** Writes the state as a module object in the format written by Module::toJson(), without "id" and "version".
+Binary data is not written, so snapshots of BinaryStateModules have no "data".
+*/
+	json_t* toJson() const {
+		json_t* moduleJ = json_object();
+		if (!pluginSlug.empty())
+			json_object_set_new(moduleJ, "plugin", json_string(pluginSlug.c_str()));
+		if (!modelSlug.empty())
+			json_object_set_new(moduleJ, "model", json_string(modelSlug.c_str()));
+
+		json_t* paramsJ = json_array();
+		for (size_t i = 0; i < params.size(); i++) {
+			if (!std::isfinite(params[i]))
+				continue;
+			json_t* paramJ = json_object();
+			json_object_set_new(paramJ, "value", json_real(params[i]));
+			json_object_set_new(paramJ, "id", json_integer(i));
+			json_array_append_new(paramsJ, paramJ);
+		}
+		json_object_set_new(moduleJ, "params", paramsJ);
+
+		if (bypass)
+			json_object_set_new(moduleJ, "bypass", json_boolean(true));
+		if (dataJ)
+			json_object_set(moduleJ, "data", dataJ);
+		return moduleJ;
+	}
+
+	/** Reads the state from a module object of a patch, in the format written by Module::toJson(). */
+	void fromJson(json_t* moduleJ) {
+		json_t* idJ = json_object_get(moduleJ, "id");
+		if (idJ)
+			moduleId = json_integer_value(idJ);
+
+		const char* plugin = json_string_value(json_object_get(moduleJ, "plugin"));
+		pluginSlug = plugin ? plugin : "";
+		const char* model = json_string_value(json_object_get(moduleJ, "model"));
+		modelSlug = model ? model : "";
+
+		params.clear();
+		json_t* paramsJ = json_object_get(moduleJ, "params");
+		size_t i;
+		json_t* paramJ;
+		json_array_foreach(paramsJ, i, paramJ) {
+			json_t* valueJ = json_object_get(paramJ, "value");
+			if (!valueJ)
+				continue;
+			// Legacy patches have no param IDs and store params in order
+			json_t* paramIdJ = json_object_get(paramJ, "id");
+			size_t paramId = paramIdJ ? json_integer_value(paramIdJ) : i;
+			if (paramId >= params.size())
+				params.resize(paramId + 1, NAN);
+			params[paramId] = json_number_value(valueJ);
+		}
+
+		json_t* bypassJ = json_object_get(moduleJ, "bypass");
+		bypass = bypassJ && json_boolean_value(bypassJ);
+
+		json_t* dataJ = json_object_get(moduleJ, "data");
+		setData(dataJ ? json_incref(dataJ) : NULL);
+		binary = NULL;
+	}
+};
+
+
+/** Snapshots of many modules, for switching between patches with the same modules (e.g. scenes of a live set) without clearing and rebuilding the rack.
+
+A snapshot can be parsed from a patch file on a background thread with loadFile(), so switching only costs restore().
+Modules of the snapshot are matched to the engine's modules by ID and Model. Modules missing from either side or with a different Model are skipped, so patches with different modules must still be loaded with PatchManager::load().
+Only params, bypass, and module data are switched. Cables are left unchanged.
+*/
+struct PatchSnapshot {
+	std::map<int, ModuleSnapshot> modules;
+
+	void capture(const std::vector<Module*>& modules) {
+		this->modules.clear();
+		for (Module* module : modules) {
+			this->modules[module->id].capture(module);
+		}
+	}
+
+	/** Restores all modules which exist in the engine with the same Model.
+	Returns the number of modules restored.
+	*/
+	int restore(Engine* engine) {
+		int count = 0;
+		for (auto& pair : modules) {
+			Module* module = engine->getModule(pair.first);
+			if (!module)
+				continue;
+			ModuleSnapshot& snapshot = pair.second;
+			// The ID may belong to a different module in the current patch
+			if (!snapshot.matches(module))
+				continue;
+			snapshot.restore(module);
+			if (module->bypass != snapshot.bypass)
+				engine->bypassModule(module, snapshot.bypass);
+			count++;
+		}
+		return count;
+	}
+
+	void fromJson(json_t* rootJ) {
+		modules.clear();
+		json_t* modulesJ = json_object_get(rootJ, "modules");
+		size_t i;
+		json_t* moduleJ;
+		json_array_foreach(modulesJ, i, moduleJ) {
+			ModuleSnapshot snapshot;
+			snapshot.fromJson(moduleJ);
+			if (snapshot.moduleId < 0)
+				continue;
+			modules[snapshot.moduleId] = snapshot;
+		}
+	}
+
+	/** Parses the modules of a patch file.
+	Does not touch the engine, so it is safe to call from a background thread.
+	*/
+	bool loadFile(const std::string& path) {
+		json_error_t error;
+		json_t* rootJ = json_load_file(path.c_str(), 0, &error);
+		if (!rootJ) {
+			WARN("Could not parse patch %s: %s %d:%d", path.c_str(), error.text, error.line, error.column);
+			return false;
+		}
+		DEFER({
+			json_decref(rootJ);
+		});
+		fromJson(rootJ);
+		return true;
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
@@ -0,0 +1,190 @@
+#pragma once
+#include <common.hpp>
+#include <settings.hpp>
+#include <system.hpp>
+#include <engine/Denormals.hpp>
+#include <pmmintrin.h>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Helper threads for splitting the work of a heavy module across cores.
+Use parallelFor() instead of this class directly.
+
+The pool only has as many threads as the logical cores not used by the engine's threads (settings::threadCount), so it doesn't oversubscribe the CPU.
+Only one parallelFor() runs on the pool at a time. Concurrent calls from other engine threads run serially on their own thread.
+Idle helpers spin briefly after each job so consecutive blocks start quickly, then sleep until the next job.
+*/
+struct ParallelPool {
+	/** The job generation in the upper 32 bits and the next index to claim in the lower 32 bits. */
+	std::atomic<uint64_t> word{0};
+	static const uint32_t PREPARING = UINT32_MAX;
+
+	// The current job. Only written while the index of `word` is PREPARING.
+	std::atomic<void (*)(void*, int, int)> call{NULL};
+	std::atomic<void*> context{NULL};
+	std::atomic<int> begin{0};
+	std::atomic<uint32_t> count{0};
+	std::atomic<uint32_t> grain{1};
+	/** Number of indices processed */
+	std::atomic<uint32_t> completed{0};
+
+	std::atomic<bool> busy{false};
+	std::atomic<bool> running{true};
+	std::atomic<int> sleeping{0};
+	std::mutex sleepMutex;
+	std::condition_variable sleepCv;
+	std::vector<std::thread> threads;
+	/** Number of idle iterations a helper spins before sleeping */
+	int spinCount = 20000;
+
+	/** If threadCount is negative, uses the logical cores not used by the engine. */
+	explicit ParallelPool(int threadCount = -1) {
+		if (threadCount < 0)
+			threadCount = std::max(0, system::getLogicalCoreCount() - settings::threadCount);
+		for (int i = 0; i < threadCount; i++) {
+			threads.emplace_back([this]() {
+				system::setThreadName("Parallel for");
+				system::setThreadRealTime(true);
+				// Helpers run module DSP, so flush denormals like engine threads instead of inheriting the creating thread's MXCSR
+				setFlushDenormals(true);
+				run();
+			});
+		}
+	}
+
+	~ParallelPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			running = false;
+		}
+		sleepCv.notify_all();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+
+	/** Claims and processes one chunk of the current job.
+	Returns false if there is nothing to claim.
+	*/
+	bool work() {
+		uint64_t w = word.load();
+		uint32_t index = w;
+		if (index == PREPARING)
+			return false;
+		// If the job changes after these loads, the generation in `word` changes, so the claim below fails.
+		uint32_t n = count.load();
+		if (index >= n)
+			return false;
+		void (*f)(void*, int, int) = call.load();
+		void* ctx = context.load();
+		int b = begin.load();
+		uint32_t next = std::min(index + grain.load(), n);
+		if (!word.compare_exchange_strong(w, (w & ~uint64_t(UINT32_MAX)) | next))
+			return true;
+		f(ctx, b + index, b + next);
+		completed += next - index;
+		return true;
+	}
+
+	/** Returns whether `w` holds a published job of a later generation than `generation`. */
+	static bool isNewJob(uint64_t w, uint64_t generation) {
+		return (w >> 32) != generation && uint32_t(w) != PREPARING;
+	}
+
+	void run() {
+		int idle = 0;
+		while (running) {
+			if (work()) {
+				idle = 0;
+				continue;
+			}
+			if (++idle < spinCount) {
+				_mm_pause();
+				continue;
+			}
+			// Sleep until the next job is published. `idle` isn't reset, so a helper which wakes for a job that's already done goes back to sleep without spinning.
+			uint64_t generation = word.load() >> 32;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleeping++;
+			sleepCv.wait(lock, [&]() {
+				return !running || isNewJob(word.load(), generation);
+			});
+			sleeping--;
+		}
+	}
+
+	/** Calls `f(context, i, j)` for consecutive ranges [i, j) covering [begin, end), on the calling thread and the helpers.
+	Returns when all ranges are processed.
+	*/
+	void run(int begin, int end, int grain, void (*f)(void*, int, int), void* context) {
+		uint64_t generation = (word.load() >> 32) + 1;
+		word.exchange((generation << 32) | PREPARING);
+		this->call = f;
+		this->context = context;
+		this->begin = begin;
+		this->count = end - begin;
+		this->grain = std::max(grain, 1);
+		completed = 0;
+		word = (generation << 32);
+		if (sleeping > 0) {
+			// Notify under the mutex, so a helper can't miss the job between checking `word` and waiting
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCv.notify_all();
+		}
+
+		// Help until all chunks are claimed, then wait for helpers to finish theirs
+		while (work());
+		uint32_t n = end - begin;
+		while (completed.load() < n) {
+			_mm_pause();
+		}
+	}
+};
+
+
+/** Returns the shared pool.
+Never destroyed, like getTaskPool().
+*/
+inline ParallelPool& getParallelPool() {
+	static ParallelPool* pool = new ParallelPool;
+	return *pool;
+}
+
+
+/** Calls `f(i)` for each i in [begin, end), split across the calling thread and the ParallelPool.
+Indices are claimed in chunks of `grain`, so choose a grain which makes each chunk worth at least a few microseconds, e.g. one voice of a physical model.
+
+Module::process() is called once per sample, so split work across threads only in modules which process blocks of samples, e.g. a convolver with a block size of 256.
+Calls from within `f` and calls while another module is using the pool run serially.
+*/
+template <typename F>
+void parallelFor(int begin, int end, F f, int grain = 1) {
+	if (end <= begin)
+		return;
+	ParallelPool& pool = getParallelPool();
+	if (pool.threads.empty() || end - begin <= grain || pool.busy.exchange(true)) {
+		for (int i = begin; i < end; i++) {
+			f(i);
+		}
+		return;
+	}
+	pool.run(begin, end, grain, [](void* context, int i, int j) {
+		F& f = *static_cast<F*>(context);
+		for (; i < j; i++) {
+			f(i);
+		}
+	}, &f);
+	pool.busy = false;
+}
+
+
+} // namespace engine
+} // namespace rack
@@ -1,6 +1,7 @@
 #pragma once
 #include <Quantity.hpp>
 #include <engine/Param.hpp>
+#include <simd/functions.hpp>
 
 
 namespace rack {
@@ -58,5 +59,158 @@ struct ParamQuantity : Quantity {
 };
 
 
+/** A ParamQuantity which caches its display value string until the param value changes.
+Tooltips and displays call getDisplayValueString() every frame, which formats a new string each time.
+Use it in place of ParamQuantity with
+
+	configParam<CachedParamQuantity<>>(...);
+
+or wrap a custom quantity with `CachedParamQuantity<MyParamQuantity>`, as long as its display string only depends on the param value.
+*/
+template <class TParamQuantity = ParamQuantity>
+struct CachedParamQuantity : TParamQuantity {
+	bool cached = false;
+	float cachedValue = 0.f;
+	std::string cachedString;
+
+	std::string getDisplayValueString() override {
+		float value = this->module ? this->getSmoothValue() : this->getValue();
+		if (!cached || value != cachedValue) {
+			cachedString = TParamQuantity::getDisplayValueString();
+			cachedValue = value;
+			cached = true;
+		}
+		return cachedString;
+	}
+};
+
+
+/** Converts param values to display values with the displayBase, displayMultiplier, and displayOffset of a ParamQuantity.
+The mode and the logarithm of the base are computed once by set(), instead of on every call.
+The scalar methods evaluate the same expressions as ParamQuantity::getDisplayValue() and setDisplayValue(), so results are identical, except that -funsafe-math-optimizations may round divisions differently by 1 ulp.
+The vector and buffer methods use the approximate simd::exp() and simd::log(), for converting many values at once.
+*/
+struct DisplayConverter {
+	enum Mode {
+		LINEAR,
+		LOG,
+		EXP,
+	};
+	Mode mode = LINEAR;
+	float base = 0.f;
+	/** std::log(std::abs(base)) */
+	float logBase = 0.f;
+	float multiplier = 1.f;
+	float offset = 0.f;
+
+	DisplayConverter() {}
+	DisplayConverter(float displayBase, float displayMultiplier, float displayOffset) {
+		set(displayBase, displayMultiplier, displayOffset);
+	}
+	explicit DisplayConverter(const ParamQuantity* pq) {
+		set(pq);
+	}
+
+	void set(float displayBase, float displayMultiplier, float displayOffset) {
+		base = displayBase;
+		multiplier = displayMultiplier;
+		offset = displayOffset;
+		if (base == 0.f) {
+			mode = LINEAR;
+			logBase = 0.f;
+		}
+		else if (base < 0.f) {
+			mode = LOG;
+			logBase = std::log(-base);
+		}
+		else {
+			mode = EXP;
+			logBase = std::log(base);
+		}
+	}
+	void set(const ParamQuantity* pq) {
+		set(pq->displayBase, pq->displayMultiplier, pq->displayOffset);
+	}
+
+	/** Returns whether the converter is out of date with the ParamQuantity. */
+	bool isStale(const ParamQuantity* pq) const {
+		return pq->displayBase != base || pq->displayMultiplier != multiplier || pq->displayOffset != offset;
+	}
+
+	float toDisplay(float v) const {
+		switch (mode) {
+			case LINEAR: break;
+			case LOG: v = std::log(v) / logBase; break;
+			case EXP: v = std::pow(base, v); break;
+		}
+		return v * multiplier + offset;
+	}
+
+	float fromDisplay(float displayValue) const {
+		float v = displayValue - offset;
+		if (multiplier == 0.f)
+			v = 0.f;
+		else
+			v /= multiplier;
+		switch (mode) {
+			case LINEAR: break;
+			case LOG: v = std::pow(-base, v); break;
+			case EXP: v = std::log(v) / logBase; break;
+		}
+		return v;
+	}
+
+	simd::float_4 toDisplay(simd::float_4 v) const {
+		switch (mode) {
+			case LINEAR: break;
+			case LOG: v = simd::log(v) / logBase; break;
+			case EXP: v = simd::exp(v * logBase); break;
+		}
+		return v * multiplier + offset;
+	}
+
+	/** Converts `n` param values to display values. `in` and `out` may be the same buffer. */
+	void toDisplay(const float* in, float* out, int n) const {
+		int i = 0;
+		for (; i + 4 <= n; i += 4) {
+			toDisplay(simd::float_4::load(&in[i])).store(&out[i]);
+		}
+		for (; i < n; i++) {
+			out[i] = toDisplay(in[i]);
+		}
+	}
+};
+
+
+/** A ParamQuantity which converts display values with a DisplayConverter.
+The converter is updated when the display fields change, so they may still be set after configParam().
+Use it in place of ParamQuantity with
+
+	configParam<FastParamQuantity<>>(...);
+*/
+template <class TParamQuantity = ParamQuantity>
+struct FastParamQuantity : TParamQuantity {
+	DisplayConverter converter;
+
+	const DisplayConverter& getConverter() {
+		if (converter.isStale(this))
+			converter.set(this);
+		return converter;
+	}
+
+	float getDisplayValue() override {
+		if (!this->module)
+			return Quantity::getDisplayValue();
+		return getConverter().toDisplay(this->getSmoothValue());
+	}
+
+	void setDisplayValue(float displayValue) override {
+		if (!this->module)
+			return;
+		this->setValue(getConverter().fromDisplay(displayValue));
+	}
+};
+
+
 } // namespace engine
 } // namespace rack
@@ -182,5 +182,74 @@ struct Output : Port {};
 struct Input : Port {};
 
 
+/** Detects changes to the number of channels of a range of ports, so a module can reconfigure only when they change instead of on every sample.
+
+	ChannelTracker<NUM_INPUTS> inputTracker;
+
+	void process(const ProcessArgs& args) override {
+		if (inputTracker.update(inputs)) {
+			channels = inputTracker.getMaxChannels();
+			// Reconfigure for the new number of channels
+		}
+		...
+	}
+
+The Engine doesn't notify modules of channel changes, so update() still reads each port every call.
+It packs the channel counts into 64-bit words and compares whole words, so a call costs a few loads and a comparison rather than a branch per port.
+Doesn't allocate, so it's safe to use in process().
+*/
+template <int N>
+struct ChannelTracker {
+	/** Bits per port. Enough for 0 to PORT_MAX_CHANNELS, with 31 meaning unknown. */
+	static const int BITS = 5;
+	static const int PORTS_PER_WORD = 64 / BITS;
+	static const int WORDS = (N + PORTS_PER_WORD - 1) / PORTS_PER_WORD;
+	uint64_t words[WORDS];
+
+	ChannelTracker() {
+		reset();
+	}
+
+	/** Makes the next update() report a change. */
+	void reset() {
+		for (int w = 0; w < WORDS; w++) {
+			words[w] = UINT64_MAX;
+		}
+	}
+
+	/** Compares ports `first` to `first + N - 1` with their last number of channels.
+	Returns true if any changed.
+	*/
+	template <class TPorts>
+	bool update(TPorts& ports, int first = 0) {
+		bool changed = false;
+		for (int w = 0; w < WORDS; w++) {
+			uint64_t word = 0;
+			for (int i = 0; i < PORTS_PER_WORD && w * PORTS_PER_WORD + i < N; i++) {
+				word |= uint64_t(ports[first + w * PORTS_PER_WORD + i].channels) << (i * BITS);
+			}
+			changed |= (word != words[w]);
+			words[w] = word;
+		}
+		return changed;
+	}
+
+	/** Returns the last number of channels of port `first + i`, or 0 before the first update(). */
+	int getChannels(int i) const {
+		int c = (words[i / PORTS_PER_WORD] >> (i % PORTS_PER_WORD * BITS)) & 31;
+		return (c == 31) ? 0 : c;
+	}
+
+	/** Returns the maximum number of channels of the ports at the last update(). */
+	int getMaxChannels() const {
+		int max = 0;
+		for (int i = 0; i < N; i++) {
+			max = std::max(max, getChannels(i));
+		}
+		return max;
+	}
+};
+
+
 } // namespace engine
 } // namespace rack
@@ -0,0 +1,167 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Implement this interface in a Module which can trade quality for CPU time, e.g. by reducing oversampling or processing modulation at a lower rate.
+A QualityGovernor lowers the quality of these modules when the patch exceeds its CPU budget.
+
+	struct MyModule : Module, QualityScalable {
+		std::atomic<int> quality{0};
+
+		int getQualityLevels() override {
+			return 3;
+		}
+		void setQuality(int level) override {
+			quality = level;
+		}
+		void process(const ProcessArgs& args) override {
+			int oversample = 4 >> quality;
+			...
+		}
+	};
+*/
+struct QualityScalable {
+	virtual ~QualityScalable() {}
+	/** Returns the number of quality levels. Level 0 is full quality, and higher levels use less CPU. */
+	virtual int getQualityLevels() = 0;
+	/** Sets the quality level.
+	Called from the thread which calls QualityGovernor::update(), possibly while process() is running, so store the level atomically.
+	*/
+	virtual void setQuality(int level) = 0;
+};
+
+
+/** Lowers the quality of QualityScalable modules while the patch exceeds its CPU budget, and restores it when there is headroom again.
+
+Each update() lowers the most expensive scalable module by one level while the load is above `budget`.
+Once the load stays below `restoreLoad` for `restoreDelay` seconds, the most recently lowered module is restored by one level.
+Module::cpuTime is smoothed, so changes are at least `settleTime` apart to let the measurement follow.
+
+The Engine's scheduler and ProcessArgs are in libRack, so the governor doesn't run in the engine itself.
+Call update() periodically, e.g. every 0.1 seconds from the UI thread, with CPU timing enabled.
+*/
+struct QualityGovernor {
+	/** Load above which quality is lowered, as a fraction of real time */
+	float budget = 0.8f;
+	/** Load below which quality is restored */
+	float restoreLoad = 0.6f;
+	/** Seconds the load must stay below `restoreLoad` before a level is restored */
+	float restoreDelay = 2.f;
+	/** Minimum seconds between changes */
+	float settleTime = 0.25f;
+
+	/** The current level of each lowered module */
+	std::map<Module*, int> levels;
+	/** Lowered modules in order of lowering, once per level, so they are restored in reverse order. */
+	std::vector<Module*> lowered;
+	float settleTimer = 0.f;
+	float restoreTimer = 0.f;
+
+	/** Returns the load of the modules as a fraction of real time, from their Module::cpuTime.
+	`threadCount` is the number of engine threads sharing the load.
+	*/
+	static float getLoad(const std::vector<Module*>& modules, float sampleRate, int threadCount = 1) {
+		float time = 0.f;
+		for (Module* module : modules) {
+			time += module->cpuTime;
+		}
+		return time * sampleRate / std::max(threadCount, 1);
+	}
+
+	int getLevel(Module* module) const {
+		auto it = levels.find(module);
+		if (it == levels.end())
+			return 0;
+		return it->second;
+	}
+
+	void setLevel(Module* module, int level) {
+		QualityScalable* scalable = dynamic_cast<QualityScalable*>(module);
+		if (!scalable)
+			return;
+		scalable->setQuality(level);
+		if (level > 0)
+			levels[module] = level;
+		else
+			levels.erase(module);
+	}
+
+	/** Updates the quality of the modules for the current load.
+	`dt` is the time in seconds since the last call.
+	Returns true if a level was changed.
+	*/
+	bool update(const std::vector<Module*>& modules, float load, float dt) {
+		// Forget removed modules
+		std::set<Module*> current(modules.begin(), modules.end());
+		for (auto it = levels.begin(); it != levels.end();) {
+			if (current.count(it->first))
+				++it;
+			else
+				it = levels.erase(it);
+		}
+		lowered.erase(std::remove_if(lowered.begin(), lowered.end(), [&](Module* module) {
+			return !current.count(module);
+		}), lowered.end());
+
+		settleTimer += dt;
+		if (load < restoreLoad)
+			restoreTimer += dt;
+		else
+			restoreTimer = 0.f;
+		if (settleTimer < settleTime)
+			return false;
+
+		if (load > budget) {
+			// Lower the most expensive module which can be lowered further
+			Module* worst = NULL;
+			for (Module* module : modules) {
+				QualityScalable* scalable = dynamic_cast<QualityScalable*>(module);
+				if (!scalable || getLevel(module) >= scalable->getQualityLevels() - 1)
+					continue;
+				if (!worst || module->cpuTime > worst->cpuTime)
+					worst = module;
+			}
+			if (!worst)
+				return false;
+			setLevel(worst, getLevel(worst) + 1);
+			lowered.push_back(worst);
+			settleTimer = 0.f;
+			return true;
+		}
+
+		if (restoreTimer >= restoreDelay && !lowered.empty()) {
+			Module* module = lowered.back();
+			lowered.pop_back();
+			setLevel(module, getLevel(module) - 1);
+			settleTimer = 0.f;
+			restoreTimer = 0.f;
+			return true;
+		}
+		return false;
+	}
+
+	/** Restores all modules to full quality. */
+	void reset() {
+		for (auto it : levels) {
+			if (QualityScalable* scalable = dynamic_cast<QualityScalable*>(it.first))
+				scalable->setQuality(0);
+		}
+		levels.clear();
+		lowered.clear();
+		settleTimer = 0.f;
+		restoreTimer = 0.f;
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
@@ -0,0 +1,191 @@
+#pragma once
+#include <common.hpp>
+#include <logger.hpp>
+#include <system.hpp>
+#include <engine/Module.hpp>
+#include <plugin/Model.hpp>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <cstdlib>
+#include <new>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Debugging aid for finding allocations and blocking calls in Module::process().
+
+Allocating memory, formatting strings, and locking mutexes on the audio thread can take an unbounded amount of time and cause dropouts.
+While a RealtimeScope is active on a thread, checkRealtime() reports the module and stack trace of the caller.
+To check a module, wrap it when creating its Model.
+
+	Model* modelMyModule = createModel<RealtimeChecked<MyModule>, MyModuleWidget>("MyModule");
+
+Allocations are intercepted by replacing the global operator new and delete.
+Write
+
+	RACK_REALTIME_GUARD_DEFINE_OPERATOR_NEW()
+
+in exactly one source file of your plugin.
+On Linux, also add `LDFLAGS += -Wl,-Bsymbolic-functions` to your Makefile so the plugin's allocations bind to the replacement instead of the global one.
+Allocations made inside precompiled libraries (e.g. libstdc++'s std::string) bypass the replacement and are not detected.
+*/
+struct RealtimeGuard {
+	/** Clearing this disables all checks without rebuilding. */
+	std::atomic<bool> enabled{true};
+
+	std::mutex mutex;
+	/** Reported (model, reason) pairs, so each violation is only logged once. */
+	std::set<std::pair<const plugin::Model*, const char*>> reported;
+	std::atomic<int> violationCount{0};
+
+	struct ThreadState {
+		const Module* module = NULL;
+		bool reporting = false;
+	};
+
+	static ThreadState& getThreadState() {
+		static thread_local ThreadState state;
+		return state;
+	}
+
+	/** Reports a violation of the current thread's module.
+	Reporting allocates and locks, but the thread has already violated real-time constraints by reaching this point.
+	*/
+	void report(const Module* module, const char* reason) {
+		violationCount++;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!reported.insert(std::make_pair(module->model, reason)).second)
+				return;
+		}
+		std::string slug = "unknown module";
+		if (module->model)
+			slug = (module->model->plugin ? module->model->plugin->slug : "") + "/" + module->model->slug;
+		std::string stackTrace = system::getStackTrace();
+		// The async log truncates long messages, so write the stack trace directly.
+		logger::log(logger::WARN_LEVEL, __FILE__, __LINE__, "Real-time violation (%s) in %s process()\n%s", reason, slug.c_str(), stackTrace.c_str());
+	}
+};
+
+
+inline RealtimeGuard& getRealtimeGuard() {
+	// Never destroyed, since operator new may be called during static destruction
+	static RealtimeGuard* guard = new RealtimeGuard;
+	return *guard;
+}
+
+
+/** Marks the calling thread as processing `module` until the scope ends. */
+struct RealtimeScope {
+	const Module* previous;
+
+	explicit RealtimeScope(const Module* module) {
+		RealtimeGuard::ThreadState& state = RealtimeGuard::getThreadState();
+		previous = state.module;
+		state.module = module;
+	}
+	~RealtimeScope() {
+		RealtimeGuard::getThreadState().module = previous;
+	}
+};
+
+
+/** Call before an operation which is not allowed on the audio thread, e.g. file I/O.
+Does nothing outside a RealtimeScope.
+*/
+inline void checkRealtime(const char* reason) {
+	RealtimeGuard::ThreadState& state = RealtimeGuard::getThreadState();
+	if (!state.module || state.reporting)
+		return;
+	// Don't report allocations made while reporting, including the guard's own construction
+	state.reporting = true;
+	DEFER({
+		state.reporting = false;
+	});
+	RealtimeGuard& guard = getRealtimeGuard();
+	if (!guard.enabled)
+		return;
+	guard.report(state.module, reason);
+}
+
+
+/** Checks real-time violations in the process() method of TModule. */
+template <class TModule>
+struct RealtimeChecked : TModule {
+	void process(const Module::ProcessArgs& args) override {
+		RealtimeScope scope(this);
+		TModule::process(args);
+	}
+};
+
+
+/** A mutex which reports locking from a RealtimeScope.
+Use it in place of std::mutex for data shared between process() and other threads, e.g.
+
+	RealtimeCheckedMutex mutex;
+*/
+template <class TMutex = std::mutex>
+struct TRealtimeCheckedMutex : TMutex {
+	void lock() {
+		checkRealtime("mutex lock");
+		TMutex::lock();
+	}
+};
+
+typedef TRealtimeCheckedMutex<> RealtimeCheckedMutex;
+
+
+} // namespace engine
+} // namespace rack
+
+
+/** Defines replacements of the global operator new and delete which call checkRealtime().
+Use in exactly one source file.
+*/
+#define RACK_REALTIME_GUARD_DEFINE_OPERATOR_NEW() \
+	__attribute__((noinline)) void* operator new(size_t size) { \
+		rack::engine::checkRealtime("operator new"); \
+		void* p = std::malloc(size ? size : 1); \
+		if (!p) \
+			throw std::bad_alloc(); \
+		return p; \
+	} \
+	__attribute__((noinline)) void* operator new[](size_t size) { \
+		rack::engine::checkRealtime("operator new[]"); \
+		void* p = std::malloc(size ? size : 1); \
+		if (!p) \
+			throw std::bad_alloc(); \
+		return p; \
+	} \
+	__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept { \
+		rack::engine::checkRealtime("operator new"); \
+		return std::malloc(size ? size : 1); \
+	} \
+	__attribute__((noinline)) void* operator new[](size_t size, const std::nothrow_t&) noexcept { \
+		rack::engine::checkRealtime("operator new[]"); \
+		return std::malloc(size ? size : 1); \
+	} \
+	__attribute__((noinline)) void operator delete(void* p) noexcept { \
+		if (p) \
+			rack::engine::checkRealtime("operator delete"); \
+		std::free(p); \
+	} \
+	__attribute__((noinline)) void operator delete[](void* p) noexcept { \
+		if (p) \
+			rack::engine::checkRealtime("operator delete[]"); \
+		std::free(p); \
+	} \
+	__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { \
+		if (p) \
+			rack::engine::checkRealtime("operator delete"); \
+		std::free(p); \
+	} \
+	__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { \
+		if (p) \
+			rack::engine::checkRealtime("operator delete[]"); \
+		std::free(p); \
+	}
@@ -0,0 +1,445 @@
+#pragma once
+#include <common.hpp>
+#include <plugin.hpp>
+#include <engine/Module.hpp>
+#include <engine/Cable.hpp>
+#include <engine/ModuleSnapshot.hpp>
+#include <engine/TopologicalProcessor.hpp>
+#include <jansson.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdlib>
+#include <set>
+#include <mutex>
+#include <algorithm>
+
+
+namespace rack {
+namespace engine {
+
+
+/** A reusable group of modules and the cables between them, e.g. one voice of VCO -> VCF -> VCA.
+Subpatch instances are created from a template.
+*/
+struct SubpatchTemplate {
+	struct ModuleEntry {
+		plugin::Model* model;
+		ModuleSnapshot state;
+		int inputCount = 0;
+		int outputCount = 0;
+	};
+	/** A cable between modules, by index in `modules` */
+	struct CableEntry {
+		int outputModule;
+		int outputId;
+		int inputModule;
+		int inputId;
+	};
+	/** A port of a module exposed to the host of the subpatch */
+	struct PortEntry {
+		int module;
+		int portId;
+	};
+
+	std::vector<ModuleEntry> modules;
+	std::vector<CableEntry> cables;
+	std::vector<PortEntry> inputs;
+	std::vector<PortEntry> outputs;
+
+	/** Captures the state of the modules and the cables between them. Cables to other modules are skipped. */
+	void capture(const std::vector<Module*>& modules, const std::vector<Cable*>& cables) {
+		this->modules.clear();
+		this->cables.clear();
+		std::map<const Module*, int> indices;
+		for (Module* module : modules) {
+			indices[module] = this->modules.size();
+			ModuleEntry entry;
+			entry.model = module->model;
+			entry.state.capture(module);
+			entry.inputCount = module->inputs.size();
+			entry.outputCount = module->outputs.size();
+			// Keep JSON data for toJson() even if the module supports binary state
+			if (entry.state.binary)
+				entry.state.setData(module->dataToJson());
+			this->modules.push_back(entry);
+		}
+		for (Cable* cable : cables) {
+			auto outputIt = indices.find(cable->outputModule);
+			auto inputIt = indices.find(cable->inputModule);
+			if (outputIt == indices.end() || inputIt == indices.end())
+				continue;
+			CableEntry entry;
+			entry.outputModule = outputIt->second;
+			entry.outputId = cable->outputId;
+			entry.inputModule = inputIt->second;
+			entry.inputId = cable->inputId;
+			this->cables.push_back(entry);
+		}
+	}
+
+	json_t* toJson() const {
+		json_t* rootJ = json_object();
+
+		json_t* modulesJ = json_array();
+		for (const ModuleEntry& entry : modules) {
+			json_t* moduleJ = json_object();
+			json_object_set_new(moduleJ, "plugin", json_string(entry.model->plugin->slug.c_str()));
+			json_object_set_new(moduleJ, "model", json_string(entry.model->slug.c_str()));
+			json_t* paramsJ = json_array();
+			for (float value : entry.state.params) {
+				json_array_append_new(paramsJ, json_real(value));
+			}
+			json_object_set_new(moduleJ, "params", paramsJ);
+			if (entry.state.bypass)
+				json_object_set_new(moduleJ, "bypass", json_true());
+			if (entry.state.dataJ)
+				json_object_set(moduleJ, "data", entry.state.dataJ);
+			json_array_append_new(modulesJ, moduleJ);
+		}
+		json_object_set_new(rootJ, "modules", modulesJ);
+
+		// Cables and ports are stored as compact arrays of integers
+		json_t* cablesJ = json_array();
+		for (const CableEntry& entry : cables) {
+			json_array_append_new(cablesJ, json_pack("[iiii]", entry.outputModule, entry.outputId, entry.inputModule, entry.inputId));
+		}
+		json_object_set_new(rootJ, "cables", cablesJ);
+
+		auto portsToJson = [](const std::vector<PortEntry>& ports) {
+			json_t* portsJ = json_array();
+			for (const PortEntry& entry : ports) {
+				json_array_append_new(portsJ, json_pack("[ii]", entry.module, entry.portId));
+			}
+			return portsJ;
+		};
+		json_object_set_new(rootJ, "inputs", portsToJson(inputs));
+		json_object_set_new(rootJ, "outputs", portsToJson(outputs));
+		return rootJ;
+	}
+
+	/** Returns whether `module` is the index of a module of the template and `portId` one of its inputs, or outputs if `output` is true. */
+	bool isValidPort(int module, int portId, bool output) const {
+		if (module < 0 || module >= (int) modules.size())
+			return false;
+		const ModuleEntry& entry = modules[module];
+		return portId >= 0 && portId < (output ? entry.outputCount : entry.inputCount);
+	}
+
+	/** Returns false if a model of the template isn't installed.
+	Cables and ports which refer to modules or ports that don't exist, e.g. of an older version of a module, are skipped.
+	*/
+	bool fromJson(json_t* rootJ) {
+		modules.clear();
+		cables.clear();
+		inputs.clear();
+		outputs.clear();
+
+		size_t i;
+		json_t* moduleJ;
+		json_array_foreach(json_object_get(rootJ, "modules"), i, moduleJ) {
+			const char* pluginSlug = json_string_value(json_object_get(moduleJ, "plugin"));
+			const char* modelSlug = json_string_value(json_object_get(moduleJ, "model"));
+			plugin::Model* model = (pluginSlug && modelSlug) ? plugin::getModel(pluginSlug, modelSlug) : NULL;
+			if (!model) {
+				WARN("Subpatch module %s %s not found", pluginSlug, modelSlug);
+				modules.clear();
+				return false;
+			}
+			ModuleEntry entry;
+			entry.model = model;
+			// Port counts are only known by creating the module
+			Module* module = model->createModule();
+			if (module) {
+				entry.inputCount = module->inputs.size();
+				entry.outputCount = module->outputs.size();
+				delete module;
+			}
+			entry.state.bypass = json_is_true(json_object_get(moduleJ, "bypass"));
+			size_t j;
+			json_t* paramJ;
+			json_array_foreach(json_object_get(moduleJ, "params"), j, paramJ) {
+				entry.state.params.push_back(json_number_value(paramJ));
+			}
+			json_t* dataJ = json_object_get(moduleJ, "data");
+			entry.state.setData(dataJ ? json_incref(dataJ) : NULL);
+			modules.push_back(entry);
+		}
+
+		json_t* cableJ;
+		json_array_foreach(json_object_get(rootJ, "cables"), i, cableJ) {
+			CableEntry entry;
+			if (json_unpack(cableJ, "[iiii]", &entry.outputModule, &entry.outputId, &entry.inputModule, &entry.inputId))
+				continue;
+			if (!isValidPort(entry.outputModule, entry.outputId, true) || !isValidPort(entry.inputModule, entry.inputId, false)) {
+				WARN("Subpatch cable %d:%d -> %d:%d skipped, port not found", entry.outputModule, entry.outputId, entry.inputModule, entry.inputId);
+				continue;
+			}
+			cables.push_back(entry);
+		}
+
+		auto portsFromJson = [&](json_t* portsJ, std::vector<PortEntry>& ports, bool output) {
+			size_t i;
+			json_t* portJ;
+			json_array_foreach(portsJ, i, portJ) {
+				PortEntry entry;
+				if (json_unpack(portJ, "[ii]", &entry.module, &entry.portId))
+					continue;
+				// Keep the entry so the host's port indices don't shift, and leave it unconnected
+				if (!isValidPort(entry.module, entry.portId, output))
+					WARN("Subpatch %s %d:%d not found", output ? "output" : "input", entry.module, entry.portId);
+				ports.push_back(entry);
+			}
+		};
+		portsFromJson(json_object_get(rootJ, "inputs"), inputs, false);
+		portsFromJson(json_object_get(rootJ, "outputs"), outputs, true);
+		return true;
+	}
+};
+
+
+/** An instance of a SubpatchTemplate, processed as one unit, e.g. by a polyphonic container module which runs one instance per voice.
+
+Modules are processed in topological order by a TopologicalProcessor, so cables within the subpatch add no latency.
+Its modules are not added to the Engine, so modules which access the Engine or their expanders in process() are not supported.
+They do receive onAdd() and onRemove(), and module IDs unique to the instance, so Module::seedRandom() gives each voice its own stream.
+An instance stores only the params and data which differ from its template, so many copies serialize compactly.
+*/
+struct Subpatch {
+	const SubpatchTemplate* tmpl = NULL;
+	std::vector<Module*> modules;
+	std::vector<Cable*> cables;
+	TopologicalProcessor processor;
+	/** ID of the first module. Modules are numbered consecutively in template order. */
+	int baseId = -1;
+	/** The ports exposed by the template, or NULL if not found */
+	std::vector<Input*> inputPorts;
+	std::vector<Output*> outputPorts;
+
+	Subpatch() {}
+	// Owns its modules and cables
+	Subpatch(const Subpatch&) = delete;
+	Subpatch& operator=(const Subpatch&) = delete;
+	~Subpatch() {
+		clear();
+	}
+
+	/** The first module ID of each live instance, so restoring a saved instance twice, e.g. by duplicating its host module, doesn't repeat IDs. */
+	struct IdRegistry {
+		std::mutex mutex;
+		std::set<int> baseIds;
+		int nextId = 1 << 30;
+	};
+	static IdRegistry& getIdRegistry() {
+		// Never freed, since instances may be destroyed during static destruction
+		static IdRegistry* registry = new IdRegistry;
+		return *registry;
+	}
+
+	/** Reserves `count` module IDs starting at `baseId`, or at an unused ID if `baseId` is negative or already in use.
+	IDs start far above those the Engine assigns, so they don't collide with modules of the patch.
+	*/
+	static int reserveIds(int count, int baseId = -1) {
+		IdRegistry& registry = getIdRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		if (baseId < 0 || registry.baseIds.count(baseId)) {
+			baseId = registry.nextId;
+		}
+		registry.nextId = std::max(registry.nextId, baseId + std::max(count, 1));
+		registry.baseIds.insert(baseId);
+		return baseId;
+	}
+
+	static void releaseIds(int baseId) {
+		IdRegistry& registry = getIdRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.baseIds.erase(baseId);
+	}
+
+	void clear() {
+		for (Module* module : modules) {
+			module->onRemove();
+		}
+		for (Cable* cable : cables) {
+			delete cable;
+		}
+		cables.clear();
+		for (Module* module : modules) {
+			delete module;
+		}
+		modules.clear();
+		inputPorts.clear();
+		outputPorts.clear();
+		processor = TopologicalProcessor();
+		tmpl = NULL;
+		if (baseId >= 0)
+			releaseIds(baseId);
+		baseId = -1;
+	}
+
+	/** Creates the modules and cables of the template, with the template's state.
+	The template must outlive the instance.
+	If `baseId` is negative, unused module IDs are chosen.
+	*/
+	void instantiate(const SubpatchTemplate* tmpl, int baseId = -1) {
+		create(tmpl, baseId);
+		add();
+	}
+
+	/** Creates the modules and cables without calling onAdd(). */
+	void create(const SubpatchTemplate* tmpl, int baseId) {
+		clear();
+		this->tmpl = tmpl;
+		this->baseId = reserveIds(tmpl->modules.size(), baseId);
+		for (size_t i = 0; i < tmpl->modules.size(); i++) {
+			const SubpatchTemplate::ModuleEntry& entry = tmpl->modules[i];
+			Module* module = entry.model->createModule();
+			// Consecutive IDs keep the template order for the processor
+			module->id = this->baseId + i;
+			entry.state.restore(module);
+			module->bypass = entry.state.bypass;
+			modules.push_back(module);
+			processor.addModule(module);
+		}
+		auto isValid = [&](int module, int portId, bool output) {
+			if (module < 0 || module >= (int) modules.size())
+				return false;
+			return portId >= 0 && portId < (int) (output ? modules[module]->outputs.size() : modules[module]->inputs.size());
+		};
+		for (size_t i = 0; i < tmpl->cables.size(); i++) {
+			const SubpatchTemplate::CableEntry& entry = tmpl->cables[i];
+			if (!isValid(entry.outputModule, entry.outputId, true) || !isValid(entry.inputModule, entry.inputId, false))
+				continue;
+			Cable* cable = new Cable;
+			cable->id = i;
+			cable->outputModule = modules[entry.outputModule];
+			cable->outputId = entry.outputId;
+			cable->inputModule = modules[entry.inputModule];
+			cable->inputId = entry.inputId;
+			cables.push_back(cable);
+			processor.addCable(cable);
+		}
+		for (const SubpatchTemplate::PortEntry& entry : tmpl->inputs) {
+			inputPorts.push_back(isValid(entry.module, entry.portId, false) ? &modules[entry.module]->inputs[entry.portId] : NULL);
+		}
+		for (const SubpatchTemplate::PortEntry& entry : tmpl->outputs) {
+			outputPorts.push_back(isValid(entry.module, entry.portId, true) ? &modules[entry.module]->outputs[entry.portId] : NULL);
+		}
+	}
+
+	/** Calls onAdd() of the modules, once their state is restored. */
+	void add() {
+		for (Module* module : modules) {
+			module->onAdd();
+		}
+	}
+
+	/** Processes one frame.
+	`inputs` and `outputs` are the host's ports, matched by index to the template's exposed ports. Either may be NULL.
+	*/
+	void process(const Module::ProcessArgs& args, const Input* inputs, Output* outputs) {
+		if (inputs) {
+			for (size_t i = 0; i < inputPorts.size(); i++) {
+				Input* input = inputPorts[i];
+				if (!input)
+					continue;
+				input->channels = inputs[i].channels;
+				for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+					input->voltages[c] = inputs[i].voltages[c];
+				}
+			}
+		}
+		processor.process(args);
+		if (outputs) {
+			for (size_t i = 0; i < outputPorts.size(); i++) {
+				Output* output = outputPorts[i];
+				if (!output)
+					continue;
+				outputs[i].channels = output->channels;
+				for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+					outputs[i].voltages[c] = output->voltages[c];
+				}
+			}
+		}
+	}
+
+	void onSampleRateChange() {
+		for (Module* module : modules) {
+			module->onSampleRateChange();
+		}
+	}
+
+	/** Stores the module IDs and the params, bypass, and data which differ from the template. */
+	json_t* toJson() {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "baseId", json_integer(baseId));
+		// [module, paramId, value] for each changed param
+		json_t* paramsJ = json_array();
+		// Indices of modules whose bypass differs
+		json_t* bypassJ = json_array();
+		json_t* dataJ = json_object();
+		for (size_t i = 0; i < modules.size(); i++) {
+			const ModuleSnapshot& base = tmpl->modules[i].state;
+			Module* module = modules[i];
+			for (size_t paramId = 0; paramId < module->params.size(); paramId++) {
+				float value = module->params[paramId].getValue();
+				if (paramId < base.params.size() && value == base.params[paramId])
+					continue;
+				json_array_append_new(paramsJ, json_pack("[iif]", (int) i, (int) paramId, value));
+			}
+			if (module->bypass != base.bypass)
+				json_array_append_new(bypassJ, json_integer(i));
+			json_t* moduleDataJ = module->dataToJson();
+			if (!moduleDataJ)
+				continue;
+			if (base.dataJ && json_equal(moduleDataJ, base.dataJ))
+				json_decref(moduleDataJ);
+			else
+				json_object_set_new(dataJ, std::to_string(i).c_str(), moduleDataJ);
+		}
+		json_object_set_new(rootJ, "params", paramsJ);
+		json_object_set_new(rootJ, "bypass", bypassJ);
+		json_object_set_new(rootJ, "data", dataJ);
+		return rootJ;
+	}
+
+	/** Restores an instance of the template with the module IDs and differences written by toJson(). */
+	void fromJson(const SubpatchTemplate* tmpl, json_t* rootJ) {
+		json_t* baseIdJ = json_object_get(rootJ, "baseId");
+		create(tmpl, baseIdJ ? json_integer_value(baseIdJ) : -1);
+		size_t i;
+		json_t* paramJ;
+		json_array_foreach(json_object_get(rootJ, "params"), i, paramJ) {
+			int moduleIndex, paramId;
+			double value;
+			if (json_unpack(paramJ, "[iif]", &moduleIndex, &paramId, &value))
+				continue;
+			if (moduleIndex < 0 || moduleIndex >= (int) modules.size())
+				continue;
+			Module* module = modules[moduleIndex];
+			if (paramId < 0 || paramId >= (int) module->params.size())
+				continue;
+			module->params[paramId].setValue(value);
+		}
+		json_t* bypassJ;
+		json_array_foreach(json_object_get(rootJ, "bypass"), i, bypassJ) {
+			int moduleIndex = json_integer_value(bypassJ);
+			if (moduleIndex < 0 || moduleIndex >= (int) modules.size())
+				continue;
+			modules[moduleIndex]->bypass = !tmpl->modules[moduleIndex].state.bypass;
+		}
+		const char* key;
+		json_t* moduleDataJ;
+		json_object_foreach(json_object_get(rootJ, "data"), key, moduleDataJ) {
+			int moduleIndex = std::atoi(key);
+			if (moduleIndex < 0 || moduleIndex >= (int) modules.size())
+				continue;
+			modules[moduleIndex]->dataFromJson(moduleDataJ);
+		}
+		add();
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
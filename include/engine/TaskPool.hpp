@@ -0,0 +1,233 @@
+#pragma once
+#include <common.hpp>
+#include <settings.hpp>
+#include <system.hpp>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace rack {
+namespace engine {
+
+
+/** A pool of low-priority threads for non-realtime work of modules, e.g. loading files or building wavetables.
+
+The threads run at normal priority, and there are only as many as the logical cores not used by the engine's threads, so background work never preempts the engine.
+Modules usually submit jobs through a TaskGroup rather than using the pool directly.
+*/
+struct TaskPool {
+	struct Job {
+		int priority;
+		/** Submission order, so jobs of equal priority run first-in first-out. */
+		uint64_t order;
+		std::function<void()> work;
+
+		bool operator<(const Job& other) const {
+			if (priority != other.priority)
+				return priority < other.priority;
+			return order > other.order;
+		}
+	};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	// Guarded by `mutex`
+	std::priority_queue<Job> jobs;
+	uint64_t nextOrder = 0;
+	bool running = true;
+	std::vector<std::thread> threads;
+
+	/** If threadCount is 0, uses the logical cores not used by the engine. */
+	explicit TaskPool(int threadCount = 0) {
+		if (threadCount <= 0)
+			threadCount = std::max(1, system::getLogicalCoreCount() - settings::threadCount);
+		for (int i = 0; i < threadCount; i++) {
+			threads.emplace_back([this]() {
+				system::setThreadName("Task pool");
+				run();
+			});
+		}
+	}
+
+	~TaskPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		cv.notify_all();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&]() {
+				return !running || !jobs.empty();
+			});
+			if (!running)
+				return;
+			std::function<void()> work = std::move(const_cast<Job&>(jobs.top()).work);
+			jobs.pop();
+			lock.unlock();
+			work();
+			lock.lock();
+		}
+	}
+
+	/** Queues a job. Higher priorities run first.
+	Locks a mutex and allocates, so don't call it from Module::process().
+	*/
+	void submit(std::function<void()> work, int priority = 0) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Job job;
+			job.priority = priority;
+			job.order = nextOrder++;
+			job.work = std::move(work);
+			jobs.push(std::move(job));
+		}
+		cv.notify_one();
+	}
+};
+
+
+/** Returns the shared pool.
+It's never destroyed, since joining threads in a static destructor deadlocks when the plugin is unloaded on Windows.
+Idle threads wait without a timeout, so they don't wake into unloaded code.
+*/
+inline TaskPool& getTaskPool() {
+	static TaskPool* pool = new TaskPool;
+	return *pool;
+}
+
+
+/** Runs jobs of a module on the TaskPool and returns their results to Module::process() through a lock-free queue.
+
+	TaskGroup<std::vector<float>> wavetableTasks;
+
+	// On the UI thread, e.g. in dataFromJson()
+	wavetableTasks.submit([=]() {
+		return loadWavetable(path);
+	});
+
+	// In process()
+	wavetableTasks.poll([&](std::vector<float>& wavetable) {
+		std::swap(this->wavetable, wavetable);
+	});
+
+	// In onRemove()
+	wavetableTasks.cancel();
+
+poll() doesn't lock or free memory, since consumed results are freed by the next submit() or cancel().
+So if the callback swaps a buffer into the module as above, the old buffer is also freed off the audio thread.
+*/
+template <typename T>
+struct TaskGroup {
+	struct Node {
+		T result;
+		Node* next = NULL;
+	};
+
+	/** Shared with submitted jobs, so results can be discarded after the group is destroyed. */
+	struct State {
+		std::atomic<bool> cancelled{false};
+		/** Completed results, most recent first. Pushed by pool threads, taken by poll(). */
+		std::atomic<Node*> completed{NULL};
+		/** Results consumed by poll(), waiting to be freed. */
+		std::atomic<Node*> consumed{NULL};
+
+		static void push(std::atomic<Node*>& stack, Node* node) {
+			node->next = stack.load(std::memory_order_relaxed);
+			while (!stack.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		static void freeAll(std::atomic<Node*>& stack) {
+			Node* node = stack.exchange(NULL, std::memory_order_acquire);
+			while (node) {
+				Node* next = node->next;
+				delete node;
+				node = next;
+			}
+		}
+
+		~State() {
+			freeAll(completed);
+			freeAll(consumed);
+		}
+	};
+
+	std::shared_ptr<State> state = std::make_shared<State>();
+	TaskPool* pool;
+
+	explicit TaskGroup(TaskPool* pool = &getTaskPool()) : pool(pool) {}
+
+	~TaskGroup() {
+		state->cancelled = true;
+	}
+
+	/** Runs `work` on the pool. Higher priorities run first.
+	Not real-time safe. Call from the UI thread or another non-audio thread.
+	*/
+	void submit(std::function<T()> work, int priority = 0) {
+		State::freeAll(state->consumed);
+		std::shared_ptr<State> state = this->state;
+		pool->submit([state, work]() {
+			if (state->cancelled)
+				return;
+			Node* node = new Node;
+			node->result = work();
+			// Discard the result if cancelled while running
+			if (state->cancelled) {
+				delete node;
+				return;
+			}
+			State::push(state->completed, node);
+		}, priority);
+	}
+
+	/** Calls `f(T& result)` for each completed job, in order of completion.
+	Lock-free and allocation-free, so it may be called from Module::process().
+	Only call it from one thread at a time.
+	*/
+	template <typename F>
+	void poll(F f) {
+		Node* node = state->completed.exchange(NULL, std::memory_order_acquire);
+		if (!node)
+			return;
+		// Reverse the stack into completion order
+		Node* ordered = NULL;
+		while (node) {
+			Node* next = node->next;
+			node->next = ordered;
+			ordered = node;
+			node = next;
+		}
+		while (ordered) {
+			Node* next = ordered->next;
+			f(ordered->result);
+			State::push(state->consumed, ordered);
+			ordered = next;
+		}
+	}
+
+	/** Skips queued jobs and discards the results of running and completed jobs.
+	Call it in Module::onRemove(), or from the thread which calls submit() when process() is not running concurrently.
+	The group can be used again afterward.
+	*/
+	void cancel() {
+		state->cancelled = true;
+		state = std::make_shared<State>();
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
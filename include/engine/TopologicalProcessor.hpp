@@ -0,0 +1,262 @@
+#pragma once
+#include <common.hpp>
+#include <engine/Module.hpp>
+#include <engine/Cable.hpp>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+
+namespace rack {
+namespace engine {
+
+
+/** Processes a set of modules in topological order of their cables, so cables along acyclic paths add no latency.
+
+The Engine processes modules in parallel and copies every cable's voltages after each frame, so each cable adds one sample of latency.
+This class is for plugins which own and process modules themselves, e.g. a container module or an offline renderer.
+Before a module is processed, the voltages of its input cables are copied from modules processed earlier in the same frame.
+Cycles are broken at the cable with the lowest ID among those remaining in the cycle, so the order doesn't depend on insertion order.
+The voltages of these feedback cables are copied at the end of the frame, adding one sample of latency like the Engine.
+
+The add and remove methods mirror Engine::addModule(), addCable(), etc. The order is recomputed lazily when modules or cables change.
+Not thread-safe. Call all methods from the thread which calls process(), or guard them with a lock.
+*/
+struct TopologicalProcessor {
+	std::vector<Module*> modules;
+	std::vector<Cable*> cables;
+
+	// Computed by update()
+	bool dirty = true;
+	std::vector<Module*> order;
+	/** The cables to copy before processing `order[i]` */
+	std::vector<std::vector<Cable*>> inputCables;
+	std::vector<Cable*> feedbackCables;
+
+	void addModule(Module* module) {
+		assert(module);
+		modules.push_back(module);
+		dirty = true;
+	}
+
+	/** Removes a module and all cables connected to it. */
+	void removeModule(Module* module) {
+		auto it = std::find(modules.begin(), modules.end(), module);
+		if (it == modules.end())
+			return;
+		modules.erase(it);
+		std::vector<Cable*> connected;
+		for (Cable* cable : cables) {
+			if (cable->outputModule == module || cable->inputModule == module)
+				connected.push_back(cable);
+		}
+		for (Cable* cable : connected) {
+			removeCable(cable);
+		}
+		dirty = true;
+	}
+
+	void addCable(Cable* cable) {
+		assert(cable);
+		assert(cable->outputModule);
+		assert(cable->inputModule);
+		// Set default number of output channels, like the Engine
+		bool outputWasConnected = false;
+		for (Cable* other : cables) {
+			if (other->outputModule == cable->outputModule && other->outputId == cable->outputId)
+				outputWasConnected = true;
+		}
+		Output& output = cable->outputModule->outputs[cable->outputId];
+		if (!outputWasConnected)
+			output.channels = 1;
+		cables.push_back(cable);
+		dirty = true;
+	}
+
+	void removeCable(Cable* cable) {
+		auto it = std::find(cables.begin(), cables.end(), cable);
+		if (it == cables.end())
+			return;
+		cables.erase(it);
+		// Disconnect the input and possibly the output, like the Engine
+		Input& input = cable->inputModule->inputs[cable->inputId];
+		input.channels = 0;
+		for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+			input.voltages[c] = 0.f;
+		}
+		bool outputIsConnected = false;
+		for (Cable* other : cables) {
+			if (other->outputModule == cable->outputModule && other->outputId == cable->outputId)
+				outputIsConnected = true;
+		}
+		if (!outputIsConnected)
+			cable->outputModule->outputs[cable->outputId].channels = 0;
+		dirty = true;
+	}
+
+	/** Returns whether the cable was chosen to break a cycle. */
+	bool isFeedback(const Cable* cable) {
+		if (dirty)
+			update();
+		return std::find(feedbackCables.begin(), feedbackCables.end(), cable) != feedbackCables.end();
+	}
+
+	/** Returns whether module `to` can be reached from module `from` through cables which aren't removed, among modules which aren't done. */
+	static bool reaches(int from, int to, const std::vector<std::vector<Cable*>>& outCables, std::map<const Module*, int>& indices, const std::vector<bool>& done, const std::set<const Cable*>& removed) {
+		std::vector<bool> visited(outCables.size(), false);
+		std::vector<int> stack;
+		stack.push_back(from);
+		visited[from] = true;
+		while (!stack.empty()) {
+			int i = stack.back();
+			stack.pop_back();
+			if (i == to)
+				return true;
+			for (Cable* cable : outCables[i]) {
+				if (removed.count(cable))
+					continue;
+				int next = indices[cable->inputModule];
+				if (done[next] || visited[next])
+					continue;
+				visited[next] = true;
+				stack.push_back(next);
+			}
+		}
+		return false;
+	}
+
+	/** Sorts the modules with Kahn's algorithm.
+	Among modules ready to be processed, the lowest module ID goes first.
+	*/
+	void update() {
+		int n = modules.size();
+		std::map<const Module*, int> indices;
+		for (int i = 0; i < n; i++) {
+			indices[modules[i]] = i;
+		}
+
+		// Cables between modules of this processor, sorted by ID so cycles are broken deterministically
+		std::vector<Cable*> internalCables;
+		std::vector<Cable*> externalCables;
+		for (Cable* cable : cables) {
+			if (indices.count(cable->outputModule) && indices.count(cable->inputModule))
+				internalCables.push_back(cable);
+			else
+				externalCables.push_back(cable);
+		}
+		std::sort(internalCables.begin(), internalCables.end(), [](const Cable* a, const Cable* b) {
+			return a->id < b->id;
+		});
+
+		std::vector<int> inDegree(n, 0);
+		std::vector<std::vector<Cable*>> outCables(n);
+		std::vector<std::vector<Cable*>> inCables(n);
+		for (Cable* cable : internalCables) {
+			int from = indices[cable->outputModule];
+			int to = indices[cable->inputModule];
+			outCables[from].push_back(cable);
+			inCables[to].push_back(cable);
+			inDegree[to]++;
+		}
+
+		// Ordered by module ID, then index
+		std::set<std::pair<int, int>> ready;
+		for (int i = 0; i < n; i++) {
+			if (inDegree[i] == 0)
+				ready.insert(std::make_pair(modules[i]->id, i));
+		}
+
+		std::set<const Cable*> removed;
+		std::vector<bool> done(n, false);
+		order.clear();
+		inputCables.clear();
+		feedbackCables.clear();
+		while ((int) order.size() < n) {
+			if (ready.empty()) {
+				// Every remaining module is in or downstream of a cycle. Break a cycle at its lowest cable.
+				for (Cable* cable : internalCables) {
+					int from = indices[cable->outputModule];
+					int to = indices[cable->inputModule];
+					if (done[from] || done[to] || removed.count(cable))
+						continue;
+					// Skip cables which aren't part of a cycle
+					if (!reaches(to, from, outCables, indices, done, removed))
+						continue;
+					removed.insert(cable);
+					feedbackCables.push_back(cable);
+					if (--inDegree[to] == 0)
+						ready.insert(std::make_pair(modules[to]->id, to));
+					break;
+				}
+				continue;
+			}
+
+			int i = ready.begin()->second;
+			ready.erase(ready.begin());
+			done[i] = true;
+			order.push_back(modules[i]);
+			std::vector<Cable*> in;
+			for (Cable* cable : inCables[i]) {
+				if (!removed.count(cable))
+					in.push_back(cable);
+			}
+			inputCables.push_back(in);
+
+			for (Cable* cable : outCables[i]) {
+				if (removed.count(cable))
+					continue;
+				int to = indices[cable->inputModule];
+				if (--inDegree[to] == 0)
+					ready.insert(std::make_pair(modules[to]->id, to));
+			}
+		}
+
+		// Cables from modules outside this processor have no ordering constraint, so copy them before their input module.
+		for (Cable* cable : externalCables) {
+			auto it = indices.find(cable->inputModule);
+			if (it == indices.end())
+				continue;
+			size_t pos = std::find(order.begin(), order.end(), cable->inputModule) - order.begin();
+			inputCables[pos].push_back(cable);
+		}
+		dirty = false;
+	}
+
+	/** Copies the voltages of a cable, like the Engine does after each frame. */
+	static void stepCable(Cable* cable) {
+		Output& output = cable->outputModule->outputs[cable->outputId];
+		Input& input = cable->inputModule->inputs[cable->inputId];
+		// Match number of polyphonic channels to output port
+		int channels = output.channels;
+		for (int c = 0; c < channels; c++) {
+			input.voltages[c] = output.voltages[c];
+		}
+		// Set higher channel voltages to 0
+		for (int c = channels; c < input.channels; c++) {
+			input.voltages[c] = 0.f;
+		}
+		input.channels = channels;
+	}
+
+	/** Processes one frame of all modules. */
+	void process(const Module::ProcessArgs& args) {
+		if (dirty)
+			update();
+		for (size_t i = 0; i < order.size(); i++) {
+			for (Cable* cable : inputCables[i]) {
+				stepCable(cable);
+			}
+			Module* module = order[i];
+			if (!module->bypass)
+				module->process(args);
+		}
+		for (Cable* cable : feedbackCables) {
+			stepCable(cable);
+		}
+	}
+};
+
+
+} // namespace engine
+} // namespace rack
@@ -1,4 +1,18 @@
 #pragma once
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#if defined ARCH_LIN
+	#include <pthread.h>
+	#include <sched.h>
+#endif
 
 
 /** Example usage:
@@ -8,11 +22,19 @@
 will print something like
 
 	[0.123 debug myfile.cpp:45] error: 67
+
+DEBUG, INFO, and WARN are rate limited per call site, so a message logged every sample can't flood the log.
+Messages are written immediately, except on real-time threads and threads which called logger::initThread().
+On those threads, DEBUG, INFO, and WARN never block.
+They format the message into a ring buffer owned by the thread, which a background thread drains to the log.
+FATAL drains the ring buffers before writing its message.
 */
-#define DEBUG(format, ...) logger::log(rack::logger::DEBUG_LEVEL, __FILE__, __LINE__, format, ##__VA_ARGS__)
-#define INFO(format, ...) logger::log(rack::logger::INFO_LEVEL, __FILE__, __LINE__, format, ##__VA_ARGS__)
-#define WARN(format, ...) logger::log(rack::logger::WARN_LEVEL, __FILE__, __LINE__, format, ##__VA_ARGS__)
-#define FATAL(format, ...) logger::log(rack::logger::FATAL_LEVEL, __FILE__, __LINE__, format, ##__VA_ARGS__)
+#define DEBUG(format, ...) RACK_LOG(rack::logger::DEBUG_LEVEL, format, ##__VA_ARGS__)
+#define INFO(format, ...) RACK_LOG(rack::logger::INFO_LEVEL, format, ##__VA_ARGS__)
+#define WARN(format, ...) RACK_LOG(rack::logger::WARN_LEVEL, format, ##__VA_ARGS__)
+#define FATAL(format, ...) (rack::logger::flush(), rack::logger::log(rack::logger::FATAL_LEVEL, __FILE__, __LINE__, format, ##__VA_ARGS__))
+
+#define RACK_LOG(level, format, ...) (rack::logger::getThreadRing() ? rack::logger::logAsync(level, __FILE__, __LINE__, format, ##__VA_ARGS__) : rack::logger::allowSync(__FILE__, __LINE__) ? rack::logger::log(level, __FILE__, __LINE__, format, ##__VA_ARGS__) : (void) 0)
 
 
 namespace rack {
@@ -38,5 +60,358 @@ Thread-safe, meaning messages cannot overlap each other in the log.
 void log(Level level, const char* filename, int line, const char* format, ...);
 
 
+/** A preformatted log message */
+struct Record {
+	Level level;
+	const char* filename;
+	int line;
+	/** Time of the call, from getClockTime() */
+	double time;
+	/** Longer messages are truncated and end with "..." */
+	char message[488];
+};
+
+
+/** Returns the time in seconds of a monotonic clock. */
+inline double getClockTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/** Single-producer single-consumer lock-free queue of log records, one per logging thread. */
+struct RecordRing {
+	static const size_t SIZE = 256;
+	Record records[SIZE];
+	std::atomic<size_t> start{0};
+	std::atomic<size_t> end{0};
+	/** Number of records dropped because the ring was full */
+	std::atomic<uint32_t> dropped{0};
+	/** Set when the owning thread exits. The writer frees the ring once it's drained. */
+	std::atomic<bool> abandoned{false};
+
+	/** Returns a record to fill, or NULL if the ring is full. Called by the producer. */
+	Record* beginPush() {
+		size_t e = end.load(std::memory_order_relaxed);
+		if (e - start.load(std::memory_order_acquire) >= SIZE)
+			return NULL;
+		return &records[e % SIZE];
+	}
+	void endPush() {
+		end.store(end.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	/** Returns the oldest record, or NULL if the ring is empty. Called by the consumer. */
+	Record* front() {
+		size_t s = start.load(std::memory_order_relaxed);
+		if (s == end.load(std::memory_order_acquire))
+			return NULL;
+		return &records[s % SIZE];
+	}
+	void pop() {
+		start.store(start.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
+
+
+/** Limits the number of messages logged per second by each call site.
+Call sites are hashed by filename pointer and line into a fixed table, so colliding sites share a limit.
+*/
+struct RateLimiter {
+	static const int SLOTS = 1024;
+	struct Slot {
+		std::atomic<int64_t> second{0};
+		std::atomic<int> count{0};
+		std::atomic<int> suppressed{0};
+		/** The last call site, for reporting suppressed messages */
+		std::atomic<const char*> filename{NULL};
+		std::atomic<int> line{0};
+	};
+	Slot slots[SLOTS];
+	/** Maximum number of messages per call site per second */
+	int limit = 20;
+
+	static int64_t getSecond() {
+		return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/** Returns whether the message may be logged. */
+	bool allow(const char* filename, int line) {
+		uintptr_t hash = reinterpret_cast<uintptr_t>(filename) * 31 + line;
+		Slot& slot = slots[(hash ^ (hash >> 16)) % SLOTS];
+		int64_t second = getSecond();
+		if (slot.second.exchange(second, std::memory_order_relaxed) != second)
+			slot.count.store(0, std::memory_order_relaxed);
+		if (slot.count.fetch_add(1, std::memory_order_relaxed) >= limit) {
+			slot.filename.store(filename, std::memory_order_relaxed);
+			slot.line.store(line, std::memory_order_relaxed);
+			slot.suppressed.fetch_add(1, std::memory_order_release);
+			return false;
+		}
+		return true;
+	}
+
+	/** Logs the number of suppressed messages of each call site whose one-second window has ended, or of all call sites if `all` is true. */
+	void report(bool all) {
+		int64_t second = getSecond();
+		for (Slot& slot : slots) {
+			if (slot.suppressed.load(std::memory_order_relaxed) == 0)
+				continue;
+			if (!all && slot.second.load(std::memory_order_relaxed) == second)
+				continue;
+			int suppressed = slot.suppressed.exchange(0, std::memory_order_acquire);
+			if (suppressed > 0)
+				log(WARN_LEVEL, slot.filename.load(std::memory_order_relaxed), slot.line.load(std::memory_order_relaxed), "%d similar messages suppressed", suppressed);
+		}
+	}
+};
+
+
+inline RateLimiter& getRateLimiter() {
+	// Never freed, so logging during static destruction still works
+	static RateLimiter* rateLimiter = new RateLimiter;
+	return *rateLimiter;
+}
+
+
+/** Do not use this function directly. Use the macros above.
+Returns whether a message may be logged synchronously, and logs the suppressed counts of call sites whose rate limit window has ended.
+*/
+inline bool allowSync(const char* filename, int line) {
+	RateLimiter& rateLimiter = getRateLimiter();
+	if (!rateLimiter.allow(filename, line))
+		return false;
+	rateLimiter.report(false);
+	return true;
+}
+
+
+/** Background thread which drains the RecordRing of each async logging thread to logger::log().
+
+The thread starts when the first ring is registered.
+When the last logging thread exits, it wakes the writer, waits for it to drain the rings and exit, and joins it.
+So once the engine's threads have exited, no thread of the writer runs plugin code, and the plugin can be unloaded.
+The writer object itself is never destroyed, so nothing is joined during static destruction or library unloading.
+*/
+struct AsyncWriter {
+	std::mutex mutex;
+	std::condition_variable cv;
+	// Guarded by `mutex`
+	std::vector<RecordRing*> rings;
+	/** Number of rings whose threads are still running */
+	int liveRings = 0;
+	bool threadRunning = false;
+	std::thread thread;
+
+	/** Registers a ring for the calling thread, and starts the writer thread if needed. */
+	RecordRing* createRing() {
+		RecordRing* ring = new RecordRing;
+		std::lock_guard<std::mutex> lock(mutex);
+		rings.push_back(ring);
+		liveRings++;
+		if (!threadRunning) {
+			// A previous writer thread has already returned, since it clears `threadRunning` just before returning
+			if (thread.joinable())
+				thread.join();
+			threadRunning = true;
+			thread = std::thread([this]() {
+				run();
+			});
+		}
+		return ring;
+	}
+
+	/** Called when the thread owning `ring` exits. */
+	void abandon(RecordRing* ring) {
+		std::thread finished;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			ring->abandoned = true;
+			liveRings--;
+			cv.notify_all();
+			if (liveRings > 0)
+				return;
+			// Wait for the writer to drain all rings and return, unless another thread starts logging meanwhile
+			cv.wait(lock, [&]() {
+				return !threadRunning || liveRings > 0;
+			});
+			if (threadRunning)
+				return;
+			finished = std::move(thread);
+		}
+		if (finished.joinable())
+			finished.join();
+	}
+
+	/** Logs queued records of all rings in order of their call time. Call with `mutex` locked. */
+	void drain() {
+		for (RecordRing* ring : rings) {
+			uint32_t dropped = ring->dropped.exchange(0);
+			if (dropped > 0)
+				log(WARN_LEVEL, __FILE__, __LINE__, "%u log messages were dropped because the log buffer was full", dropped);
+		}
+		double now = getClockTime();
+		while (true) {
+			RecordRing* oldest = NULL;
+			for (RecordRing* ring : rings) {
+				Record* r = ring->front();
+				if (r && (!oldest || r->time < oldest->front()->time))
+					oldest = ring;
+			}
+			if (!oldest)
+				break;
+			Record* r = oldest->front();
+			// log() timestamps messages when written, so note how long the message was queued
+			double delay = now - r->time;
+			if (delay >= 0.001)
+				log(r->level, r->filename, r->line, "%s (queued %.0f ms)", r->message, delay * 1000);
+			else
+				log(r->level, r->filename, r->line, "%s", r->message);
+			oldest->pop();
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			// Check before draining so that no record pushed before abandonment is lost
+			std::vector<bool> abandoned;
+			for (RecordRing* ring : rings) {
+				abandoned.push_back(ring->abandoned);
+			}
+			drain();
+			for (size_t i = rings.size(); i-- > 0;) {
+				if (abandoned[i]) {
+					delete rings[i];
+					rings.erase(rings.begin() + i);
+				}
+			}
+			bool done = rings.empty();
+			getRateLimiter().report(done);
+			if (done) {
+				threadRunning = false;
+				cv.notify_all();
+				return;
+			}
+			cv.wait_for(lock, std::chrono::milliseconds(20));
+		}
+	}
+};
+
+
+/** Returns the writer if created, or NULL. */
+inline std::atomic<AsyncWriter*>& getAsyncWriterInstance() {
+	// Trivially destructible, so it stays valid during static destruction
+	static std::atomic<AsyncWriter*> writer{NULL};
+	return writer;
+}
+
+
+inline AsyncWriter& getAsyncWriter() {
+	// Never freed, see AsyncWriter
+	static AsyncWriter* writer = getAsyncWriterInstance() = new AsyncWriter;
+	return *writer;
+}
+
+
+/** Writes all queued messages of async logging threads and all suppressed counts.
+Called by FATAL, so the messages preceding a crash reach the log.
+*/
+inline void flush() {
+	AsyncWriter* writer = getAsyncWriterInstance();
+	if (writer) {
+		std::lock_guard<std::mutex> lock(writer->mutex);
+		writer->drain();
+	}
+	getRateLimiter().report(true);
+}
+
+
+/** Owns the calling thread's ring and abandons it to the writer when the thread exits. */
+struct ThreadRing {
+	RecordRing* ring = NULL;
+	/** Whether the thread was checked for real-time scheduling */
+	bool checked = false;
+	~ThreadRing() {
+		if (ring)
+			getAsyncWriterInstance().load()->abandon(ring);
+	}
+};
+
+
+inline ThreadRing& getThreadRingOwner() {
+	static thread_local ThreadRing threadRing;
+	return threadRing;
+}
+
+
+/** Returns whether the calling thread has a real-time scheduling policy, e.g. set by system::setThreadRealTime().
+Only detected on Linux.
+*/
+inline bool isRealTimeThread() {
+#if defined ARCH_LIN
+	int policy;
+	struct sched_param param;
+	if (pthread_getschedparam(pthread_self(), &policy, &param))
+		return false;
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+#else
+	return false;
+#endif
+}
+
+
+/** Makes DEBUG, INFO, and WARN on the calling thread non-blocking, by queueing them for a background writer.
+Call it at the start of a real-time thread. It allocates and locks a mutex, but logging afterward doesn't.
+Real-time threads on Linux are detected and call it on their first message.
+Messages longer than Record::message are truncated.
+*/
+inline RecordRing* initThread() {
+	ThreadRing& threadRing = getThreadRingOwner();
+	threadRing.checked = true;
+	if (!threadRing.ring)
+		threadRing.ring = getAsyncWriter().createRing();
+	return threadRing.ring;
+}
+
+
+/** Returns the calling thread's ring, or NULL if the thread logs synchronously. */
+inline RecordRing* getThreadRing() {
+	ThreadRing& threadRing = getThreadRingOwner();
+	if (!threadRing.checked) {
+		threadRing.checked = true;
+		if (isRealTimeThread())
+			initThread();
+	}
+	return threadRing.ring;
+}
+
+
+/** Do not use this function directly. Use the macros above.
+Formats the message without allocating and queues it in the calling thread's ring, which must have been created by initThread().
+Drops the message if the ring is full or the call site exceeds its rate limit.
+*/
+inline void logAsync(Level level, const char* filename, int line, const char* format, ...) {
+	RecordRing* ring = getThreadRing();
+	double time = getClockTime();
+	if (!getRateLimiter().allow(filename, line))
+		return;
+	Record* r = ring->beginPush();
+	if (!r) {
+		ring->dropped++;
+		return;
+	}
+	r->level = level;
+	r->filename = filename;
+	r->line = line;
+	r->time = time;
+	va_list args;
+	va_start(args, format);
+	int len = std::vsnprintf(r->message, sizeof(r->message), format, args);
+	va_end(args);
+	if (len >= (int) sizeof(r->message))
+		std::memcpy(r->message + sizeof(r->message) - 4, "...", 4);
+	ring->endPush();
+}
+
+
 } // namespace logger
 } // namespace rack
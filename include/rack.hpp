@@ -25,6 +25,7 @@
 
 #include <ui/SequentialLayout.hpp>
 #include <ui/Label.hpp>
+#include <ui/TextLayoutCache.hpp>
 #include <ui/List.hpp>
 #include <ui/MenuOverlay.hpp>
 #include <ui/Tooltip.hpp>
@@ -51,6 +52,8 @@
 #include <app/MidiWidget.hpp>
 #include <app/ModuleLightWidget.hpp>
 #include <app/ModuleWidget.hpp>
+#include <app/PresetIndex.hpp>
+#include <app/ModuleClipboard.hpp>
 #include <app/MultiLightWidget.hpp>
 #include <app/ParamWidget.hpp>
 #include <app/PortWidget.hpp>
@@ -58,6 +61,7 @@
 #include <app/Scene.hpp>
 #include <app/RackScrollWidget.hpp>
 #include <app/RackWidget.hpp>
+#include <app/RackOccupancy.hpp>
 #include <app/SvgButton.hpp>
 #include <app/SvgKnob.hpp>
 #include <app/SvgPanel.hpp>
@@ -67,6 +71,8 @@
 #include <app/SvgSwitch.hpp>
 #include <app/MenuBar.hpp>
 #include <app/CableWidget.hpp>
+#include <app/CableBatch.hpp>
+#include <app/FrameTiming.hpp>
 
 #include <engine/Engine.hpp>
 #include <engine/Param.hpp>
@@ -74,6 +80,18 @@
 #include <engine/Module.hpp>
 #include <engine/Param.hpp>
 #include <engine/Cable.hpp>
+#include <engine/ModuleSnapshot.hpp>
+#include <engine/ModulePool.hpp>
+#include <engine/RealtimeGuard.hpp>
+#include <engine/Denormals.hpp>
+#include <engine/TopologicalProcessor.hpp>
+#include <engine/TaskPool.hpp>
+#include <engine/ParallelFor.hpp>
+#include <engine/ModulePlacement.hpp>
+#include <engine/ModuleDispatch.hpp>
+#include <engine/Subpatch.hpp>
+#include <engine/QualityGovernor.hpp>
+#include <engine/ControlRate.hpp>
 
 #include <plugin/Plugin.hpp>
 #include <plugin/Model.hpp>
@@ -1,5 +1,6 @@
 #pragma once
 #include <common.hpp>
+#include <simd/vector.hpp>
 #include <cstdint>
 
 
@@ -25,5 +26,305 @@ float uniform();
 float normal();
 
 
+inline void setLane(uint32_t& x, int lane, uint32_t v) {
+	x = v;
+}
+inline void setLane(simd::int32_4& x, int lane, uint32_t v) {
+	x.s[lane] = v;
+}
+
+
+/** The xoshiro128+ generator by David Blackman and Sebastiano Vigna, recommended for generating floats.
+http://prng.di.unimi.it/
+
+T may be uint32_t, or simd::int32_4 to generate 4 independent streams in parallel.
+Unlike the functions above, generators have no thread-local state, so keep one per thread or per module.
+*/
+template <typename T = uint32_t>
+struct TXoshiro128Plus {
+	static const int lanes = sizeof(T) / sizeof(uint32_t);
+	T s[4];
+
+	TXoshiro128Plus() {
+		seed(0);
+	}
+
+	/** Sets every lane to the given state, which must not be all zero. */
+	explicit TXoshiro128Plus(const uint32_t* state) {
+		for (int i = 0; i < 4; i++) {
+			s[i] = state[i];
+		}
+	}
+
+	/** Seeds the generator.
+	Lanes of vector generators are 2^64 steps apart in the sequence, so they never overlap.
+	*/
+	void seed(uint64_t seed) {
+		// Expand the seed with splitmix64, which never gives an all-zero state
+		uint32_t state[4];
+		for (int i = 0; i < 4; i += 2) {
+			uint64_t z = (seed += 0x9e3779b97f4a7c15);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+			z = z ^ (z >> 31);
+			state[i] = z;
+			state[i + 1] = z >> 32;
+		}
+		TXoshiro128Plus<uint32_t> scalar(state);
+		for (int lane = 0; lane < lanes; lane++) {
+			for (int i = 0; i < 4; i++) {
+				setLane(s[i], lane, scalar.s[i]);
+			}
+			scalar.jump();
+		}
+	}
+
+	/** Seeds the generator with one of 2^64 streams of the given seed.
+	Use it to give each of many consumers (e.g. modules) its own reproducible sequence.
+	The stream is hashed into the seed rather than reached with jump(), which would cost O(stream).
+	With 128 bits of state, sequences of different streams overlap with negligible probability.
+	*/
+	void seed(uint64_t seed, uint64_t stream) {
+		uint64_t z = stream + 0x9e3779b97f4a7c15;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		z = z ^ (z >> 31);
+		this->seed(seed ^ z);
+	}
+
+	static T rotl(T x, int k) {
+		return (x << k) | (x >> (32 - k));
+	}
+
+	/** Returns 32 uniform random bits per lane.
+	The lowest bits have low linear complexity, so use the highest bits when possible.
+	*/
+	T next() {
+		T result = s[0] + s[3];
+		T t = s[1] << 9;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 11);
+		return result;
+	}
+
+	/** Advances the generator by 2^64 steps.
+	Use it to split one seed into non-overlapping streams.
+	*/
+	void jump() {
+		static const uint32_t JUMP[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+		T s0 = 0;
+		T s1 = 0;
+		T s2 = 0;
+		T s3 = 0;
+		for (int i = 0; i < 4; i++) {
+			for (int b = 0; b < 32; b++) {
+				if (JUMP[i] & (UINT32_C(1) << b)) {
+					s0 ^= s[0];
+					s1 ^= s[1];
+					s2 ^= s[2];
+					s3 ^= s[3];
+				}
+				next();
+			}
+		}
+		s[0] = s0;
+		s[1] = s1;
+		s[2] = s2;
+		s[3] = s3;
+	}
+};
+
+typedef TXoshiro128Plus<> Xoshiro128Plus;
+typedef TXoshiro128Plus<simd::int32_4> Xoshiro128Plus_4;
+
+
+/** Converts the highest 24 bits to a float in the interval [0.0, 1.0) */
+inline float toUniform(uint32_t x) {
+	return (x >> 8) * (1.f / 16777216);
+}
+inline simd::float_4 toUniform(simd::int32_4 x) {
+	return simd::float_4(x >> 8) * (1.f / 16777216);
+}
+
+/** Returns a uniform random float in the interval [0.0, 1.0) */
+inline float uniform(Xoshiro128Plus& g) {
+	return toUniform(g.next());
+}
+inline simd::float_4 uniform(Xoshiro128Plus_4& g) {
+	return toUniform(g.next());
+}
+
+
+/** Tables for the Ziggurat method with 128 layers by Marsaglia and Tsang.
+https://www.jstatsoft.org/article/view/v005i08
+*/
+struct ZigguratTables {
+	int32_t kn[128];
+	float wn[128];
+	float fn[128];
+
+	ZigguratTables() {
+		const double m1 = 2147483648.0;
+		const double vn = 9.91256303526217e-3;
+		double dn = 3.442619855899;
+		double tn = dn;
+		double q = vn / std::exp(-0.5 * dn * dn);
+		kn[0] = (dn / q) * m1;
+		kn[1] = 0;
+		wn[0] = q / m1;
+		wn[127] = dn / m1;
+		fn[0] = 1.0;
+		fn[127] = std::exp(-0.5 * dn * dn);
+		for (int i = 126; i >= 1; i--) {
+			dn = std::sqrt(-2.0 * std::log(vn / dn + std::exp(-0.5 * dn * dn)));
+			kn[i + 1] = (dn / tn) * m1;
+			tn = dn;
+			fn[i] = std::exp(-0.5 * dn * dn);
+			wn[i] = dn / m1;
+		}
+	}
+};
+
+inline const ZigguratTables& getZigguratTables() {
+	static const ZigguratTables tables;
+	return tables;
+}
+
+/** Handles the ~1% of Ziggurat samples outside the rectangular part of their layer.
+`nextU32` returns uniform random uint32_t values.
+*/
+template <typename F>
+float zigguratFix(int32_t hz, int iz, F nextU32) {
+	const ZigguratTables& z = getZigguratTables();
+	const float r = 3.442620f;
+	// Uniform in (0.0, 1.0], so its log is finite
+	auto uni = [&]() {
+		return ((nextU32() >> 8) + 1) * (1.f / 16777216);
+	};
+	for (;;) {
+		float x = hz * z.wn[iz];
+		if (iz == 0) {
+			// Sample from the tail
+			float y;
+			do {
+				x = -std::log(uni()) / r;
+				y = -std::log(uni());
+			} while (y + y < x * x);
+			return (hz > 0) ? r + x : -r - x;
+		}
+		// Sample from the wedge
+		if (z.fn[iz] + uni() * (z.fn[iz - 1] - z.fn[iz]) < std::exp(-0.5f * x * x))
+			return x;
+		// Otherwise try again
+		hz = nextU32();
+		iz = hz & 127;
+		uint32_t absHz = (hz < 0) ? -(uint32_t) hz : hz;
+		if (absHz < (uint32_t) z.kn[iz])
+			return hz * z.wn[iz];
+	}
+}
+
+/** Returns a normal random number with mean 0 and standard deviation 1, using the Ziggurat method */
+inline float normal(Xoshiro128Plus& g) {
+	const ZigguratTables& z = getZigguratTables();
+	int32_t hz = g.next();
+	int iz = hz & 127;
+	uint32_t absHz = (hz < 0) ? -(uint32_t) hz : hz;
+	if (absHz < (uint32_t) z.kn[iz])
+		return hz * z.wn[iz];
+	return zigguratFix(hz, iz, [&]() {
+		return g.next();
+	});
+}
+
+inline simd::float_4 normal(Xoshiro128Plus_4& g) {
+	const ZigguratTables& z = getZigguratTables();
+	simd::int32_4 hz = g.next();
+	simd::int32_4 iz = hz & 127;
+	// SSE3 has no gather instruction
+	simd::int32_4 kn;
+	simd::float_4 wn;
+	for (int i = 0; i < 4; i++) {
+		kn.s[i] = z.kn[iz.s[i]];
+		wn.s[i] = z.wn[iz.s[i]];
+	}
+	simd::int32_4 sign = _mm_srai_epi32(hz.v, 31);
+	simd::int32_4 absHz = (hz ^ sign) - sign;
+	simd::float_4 x = simd::float_4(hz) * wn;
+	// Fix lanes outside the rectangles, including INT32_MIN whose absolute value overflows
+	int fix = (~simd::movemask(simd::float_4::cast(absHz < kn)) & 0xf) | simd::movemask(simd::float_4::cast(absHz));
+	if (fix) {
+		for (int i = 0; i < 4; i++) {
+			if (fix & (1 << i)) {
+				x.s[i] = zigguratFix(hz.s[i], iz.s[i], [&]() {
+					return (uint32_t) g.next().s[i];
+				});
+			}
+		}
+	}
+	return x;
+}
+
+
+/** Fills a buffer with uniform random floats in the interval [0.0, 1.0) */
+inline void uniform(Xoshiro128Plus_4& g, float* out, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uniform(g).store(&out[i]);
+	}
+	if (i < n) {
+		simd::float_4 x = uniform(g);
+		for (int j = 0; j < n - i; j++) {
+			out[i + j] = x.s[j];
+		}
+	}
+}
+
+/** Fills a buffer with normal random floats with mean 0 and standard deviation 1 */
+inline void normal(Xoshiro128Plus_4& g, float* out, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		normal(g).store(&out[i]);
+	}
+	if (i < n) {
+		simd::float_4 x = normal(g);
+		for (int j = 0; j < n - i; j++) {
+			out[i + j] = x.s[j];
+		}
+	}
+}
+
+
+/** Returns the calling thread's vector generator, seeded from u64() on first use. */
+inline Xoshiro128Plus_4& getLocal_4() {
+	static thread_local bool seeded = false;
+	static thread_local Xoshiro128Plus_4 g;
+	if (!seeded) {
+		g.seed(u64());
+		seeded = true;
+	}
+	return g;
+}
+
+/** Returns 4 uniform random floats in the interval [0.0, 1.0) from the thread-local vector generator */
+inline simd::float_4 uniform_4() {
+	return uniform(getLocal_4());
+}
+/** Returns 4 normal random floats from the thread-local vector generator */
+inline simd::float_4 normal_4() {
+	return normal(getLocal_4());
+}
+inline void uniform(float* out, int n) {
+	uniform(getLocal_4(), out, n);
+}
+inline void normal(float* out, int n) {
+	normal(getLocal_4(), out, n);
+}
+
+
 } // namespace random
 } // namespace rack
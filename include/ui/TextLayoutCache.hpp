@@ -0,0 +1,126 @@
+#pragma once
+#include <ui/common.hpp>
+#include <window.hpp>
+#include <vector>
+#include <map>
+#include <tuple>
+
+
+namespace rack {
+namespace ui {
+
+
+/** Measured layout of a single line of text */
+struct TextLayout {
+	/** Horizontal advance of the whole string */
+	float advance = 0.f;
+	/** Bounding box as [xmin, ymin, xmax, ymax], relative to the left baseline */
+	float bounds[4] = {};
+	/** x positions of each glyph relative to the left edge.
+	`NVGglyphPosition::str` is not stored since it points into the measured string.
+	*/
+	std::vector<float> glyphX;
+	/** Byte offset of each glyph in the string */
+	std::vector<int> glyphOffsets;
+	/** Length of the string in bytes */
+	int length = 0;
+
+	/** Returns the byte index of the character boundary closest to `x`, relative to the left edge. */
+	int getTextPosition(float x) const {
+		for (size_t i = 0; i < glyphX.size(); i++) {
+			float nextX = (i + 1 < glyphX.size()) ? glyphX[i + 1] : advance;
+			if (x < (glyphX[i] + nextX) / 2)
+				return glyphOffsets[i];
+		}
+		return length;
+	}
+};
+
+
+/** Caches text measurements keyed by (font, size, transform scale, string).
+
+Labels, LED displays, menus, and tooltips measure the same strings with nvgTextBounds() and nvgTextGlyphPositions() every frame, which shapes the text through fontstash each time.
+Layouts are measured with left/baseline alignment and no letter spacing.
+NanoVG rasterizes fonts at the on-screen size and rounds glyph advances in pixels, so the same string measures differently at each zoom level, and the scale of the current transform is part of the key.
+
+This only saves measuring. NanoVG has no call to draw glyphs which were already positioned, so nvgText() still shapes the string when it is drawn.
+
+The cache keeps two generations of entries. When the current generation reaches `capacity`, it becomes the previous one and the oldest generation is dropped, so strings not used for a while are eventually evicted.
+*/
+struct TextLayoutCache {
+	typedef std::tuple<int, float, float, std::string> Key;
+
+	size_t capacity = 1024;
+	std::map<Key, TextLayout> layouts;
+	std::map<Key, TextLayout> oldLayouts;
+
+	/** Returns the layout of `text` set in the given font and size under the current transform of `vg`.
+	The returned reference is valid until the next call.
+	*/
+	const TextLayout& get(NVGcontext* vg, int fontHandle, float fontSize, const std::string& text) {
+		Key key(fontHandle, fontSize, getScale(vg), text);
+		auto it = layouts.find(key);
+		if (it != layouts.end())
+			return it->second;
+
+		if (layouts.size() >= capacity) {
+			oldLayouts.clear();
+			std::swap(layouts, oldLayouts);
+		}
+
+		TextLayout& layout = layouts[key];
+		auto oldIt = oldLayouts.find(key);
+		if (oldIt != oldLayouts.end()) {
+			// Promote from previous generation
+			layout = std::move(oldIt->second);
+			oldLayouts.erase(oldIt);
+			return layout;
+		}
+
+		measure(vg, fontHandle, fontSize, text, layout);
+		return layout;
+	}
+
+	const TextLayout& get(NVGcontext* vg, std::shared_ptr<Font> font, float fontSize, const std::string& text) {
+		return get(vg, font->handle, fontSize, text);
+	}
+
+	/** Returns the scale factor of the current transform of `vg`. */
+	static float getScale(NVGcontext* vg) {
+		float t[6];
+		nvgCurrentTransform(vg, t);
+		return std::sqrt(std::fabs(t[0] * t[3] - t[1] * t[2]));
+	}
+
+	static void measure(NVGcontext* vg, int fontHandle, float fontSize, const std::string& text, TextLayout& layout) {
+		nvgSave(vg);
+		nvgFontFaceId(vg, fontHandle);
+		nvgFontSize(vg, fontSize);
+		nvgTextLetterSpacing(vg, 0.f);
+		nvgTextAlign(vg, NVG_ALIGN_LEFT | NVG_ALIGN_BASELINE);
+
+		const char* start = text.c_str();
+		const char* end = start + text.size();
+		layout.length = text.size();
+		layout.advance = nvgTextBounds(vg, 0, 0, start, end, layout.bounds);
+
+		std::vector<NVGglyphPosition> positions(text.size());
+		int count = text.empty() ? 0 : nvgTextGlyphPositions(vg, 0, 0, start, end, positions.data(), positions.size());
+		layout.glyphX.resize(count);
+		layout.glyphOffsets.resize(count);
+		for (int i = 0; i < count; i++) {
+			layout.glyphX[i] = positions[i].x;
+			layout.glyphOffsets[i] = positions[i].str - start;
+		}
+		nvgRestore(vg);
+	}
+
+	void clear() {
+		layouts.clear();
+		oldLayouts.clear();
+	}
+};
+
+
+} // namespace ui
+} // namespace rack
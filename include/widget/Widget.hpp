@@ -58,6 +58,56 @@ struct Widget {
 		return parent->getAncestorOfType<T>();
 	}
 
+	/** Same as getAncestorOfType(), but remembers the result for this widget.
+	For hot paths, like finding the RackWidget from a PortWidget on every drag move.
+	The cached ancestor is reused as long as the chain of parents is unchanged, which is checked with pointer comparisons and a single `dynamic_cast` of the ancestor instead of one for each ancestor.
+	Widgets freed and reallocated at the same address, e.g. when a patch is reloaded, pass the pointer comparisons, so the cast makes sure the result is still a T.
+	Only successful lookups are cached, since confirming that no ancestor is a T needs a cast of each ancestor anyway.
+	Only call from the UI thread.
+	*/
+	template <class T>
+	T* getAncestorOfTypeCached() {
+		const int maxDepth = 16;
+		struct Entry {
+			Widget* widget = NULL;
+			T* ancestor = NULL;
+			int depth = 0;
+			Widget* chain[maxDepth];
+		};
+		static Entry entries[64];
+		Entry& entry = entries[(reinterpret_cast<uintptr_t>(this) / sizeof(Widget)) % LENGTHOF(entries)];
+
+		if (entry.widget == this) {
+			Widget* w = parent;
+			int i = 0;
+			while (i < entry.depth && w == entry.chain[i]) {
+				w = w->parent;
+				i++;
+			}
+			// The chain was just walked from this widget, so the last widget in it is alive and safe to cast
+			if (i == entry.depth && dynamic_cast<T*>(entry.chain[i - 1]) == entry.ancestor)
+				return entry.ancestor;
+		}
+
+		entry.widget = NULL;
+		T* ancestor = NULL;
+		int depth = 0;
+		for (Widget* w = parent; w; w = w->parent) {
+			if (depth < maxDepth)
+				entry.chain[depth] = w;
+			depth++;
+			ancestor = dynamic_cast<T*>(w);
+			if (ancestor)
+				break;
+		}
+		if (ancestor && depth <= maxDepth) {
+			entry.widget = this;
+			entry.ancestor = ancestor;
+			entry.depth = depth;
+		}
+		return ancestor;
+	}
+
 	template <class T>
 	T* getFirstDescendantOfType() {
 		for (Widget* child : children) {
@@ -111,16 +161,21 @@ struct Widget {
 			if (!child->visible)
 				continue;
 
-			// Clone event for (currently) no reason
-			TEvent e2 = e;
 			// Call child event handler
-			(child->*f)(e2);
+			(child->*f)(e);
 		}
 	}
 
 	/** Recurses an event to all visible Widgets until it is consumed. */
 	template <typename TMethod, class TEvent>
 	void recursePositionEvent(TMethod f, const TEvent& e) {
+		// Offset the position of the event in place instead of cloning it for each child, since some events (e.g. PathDrop) are expensive to copy.
+		// Handlers receive a const reference, so only this method modifies `pos`.
+		TEvent& e2 = const_cast<TEvent&>(e);
+		math::Vec pos = e.pos;
+		DEFER({
+			e2.pos = pos;
+		});
 		for (auto it = children.rbegin(); it != children.rend(); it++) {
 			// Stop propagation if requested
 			if (!e.isPropagating())
@@ -129,12 +184,11 @@ struct Widget {
 			// Filter child by visibility and position
 			if (!child->visible)
 				continue;
-			if (!child->box.isContaining(e.pos))
+			if (!child->box.isContaining(pos))
 				continue;
 
-			// Clone event and adjust its position
-			TEvent e2 = e;
-			e2.pos = e.pos.minus(child->box.pos);
+			// Adjust the event position
+			e2.pos = pos.minus(child->box.pos);
 			// Call child event handler
 			(child->*f)(e2);
 		}